@@ -1,19 +1,71 @@
 #include "input.h"
+#include "odroid_adc.h"
+#include "odroid_event.h"
+#include "odroid_power.h"
+#include "odroid_latency.h"
 
 #include "driver/gpio.h"
-#include "driver/adc.h"
 #include "freertos/FreeRTOS.h"
-#include "freertos/semphr.h"
 #include "freertos/task.h"
+#include "esp_timer.h"
 #include "esp_log.h"
+#include "esp_heap_caps.h"
 
+#include <stdlib.h>
+
+
+#define INPUT_DEBOUNCE_US (10 * 1000)
+#define INPUT_POLL_PERIOD_MS (20)
+#define INPUT_IDLE_POLL_PERIOD_MS (60) // joystick rate once idle, leaves room for light sleep
+#define INPUT_IDLE_AFTER_US (2 * 1000 * 1000)
+
+typedef struct
+{
+    uint8_t button;
+    gpio_num_t pin;
+} input_pin_t;
+
+// Buttons wired to GPIOs, these are interrupt driven. The joystick is analog and still polled.
+static const input_pin_t digital_inputs[] = {
+    {ODROID_INPUT_SELECT, ODROID_GAMEPAD_IO_SELECT},
+    {ODROID_INPUT_START, ODROID_GAMEPAD_IO_START},
+    {ODROID_INPUT_A, ODROID_GAMEPAD_IO_A},
+    {ODROID_INPUT_B, ODROID_GAMEPAD_IO_B},
+    {ODROID_INPUT_MENU, ODROID_GAMEPAD_IO_MENU},
+    {ODROID_INPUT_VOLUME, ODROID_GAMEPAD_IO_VOLUME},
+};
+#define DIGITAL_INPUT_COUNT (sizeof(digital_inputs) / sizeof(input_pin_t))
 
 static volatile bool input_task_is_running = false;
-static volatile odroid_gamepad_state gamepad_state;
-static odroid_gamepad_state previous_gamepad_state;
+static TaskHandle_t input_task_handle;
+static int joystick_x = -1;
+static int joystick_y = -1;
+// One bit per button. Writers (ISR and input_task) serialize on input_lock,
+// readers just load it: an aligned 16-bit store is atomic.
+static volatile uint16_t gamepad_mask;
+static int64_t last_change[ODROID_INPUT_MAX];
+static int64_t raw_since[ODROID_INPUT_MAX];
 static uint8_t debounce[ODROID_INPUT_MAX];
 static volatile bool input_gamepad_initialized = false;
-static SemaphoreHandle_t xSemaphore;
+static portMUX_TYPE input_lock = portMUX_INITIALIZER_UNLOCKED; // writers only
+
+static odroid_input_repeat_t repeat_config = {
+    ODROID_INPUT_BIT(ODROID_INPUT_UP) | ODROID_INPUT_BIT(ODROID_INPUT_DOWN) |
+    ODROID_INPUT_BIT(ODROID_INPUT_LEFT) | ODROID_INPUT_BIT(ODROID_INPUT_RIGHT),
+    400, 120, 8, 40
+};
+static int64_t repeat_next[ODROID_INPUT_MAX];
+static uint16_t repeat_count[ODROID_INPUT_MAX];
+
+// Recording appends every queued hardware event, replaying feeds a script into
+// the queue instead of the hardware. A real press aborts the replay.
+static odroid_input_event_t* record_events;
+static int record_capacity;
+static volatile int record_count;
+static int64_t record_start;
+static odroid_input_event_t* replay_events;
+static int replay_count;
+static volatile bool replaying = false;
 
 
 
@@ -22,8 +74,8 @@ odroid_gamepad_state input_read_raw()
 {
     odroid_gamepad_state state = {0};
 
-    int joyX = adc1_get_raw(ODROID_GAMEPAD_IO_X);
-    int joyY = adc1_get_raw(ODROID_GAMEPAD_IO_Y);
+    int joyX = odroid_adc_read(joystick_x, NULL);
+    int joyY = odroid_adc_read(joystick_y, NULL);
 
     if (joyX > 2048 + 1024)
     {
@@ -69,53 +121,314 @@ odroid_gamepad_state input_read_raw()
     return state;
 }
 
+// Must be called with input_lock held, the event is queued by the caller once the lock is released
+static odroid_input_event_t input_set_state(int button, uint8_t pressed, int64_t timestamp)
+{
+    odroid_input_event_t event = {button, pressed, 0, timestamp};
+
+    if (pressed) gamepad_mask |= ODROID_INPUT_BIT(button);
+    else gamepad_mask &= ~ODROID_INPUT_BIT(button);
+
+    last_change[button] = timestamp;
+
+    return event;
+}
+
+static bool input_post_event(const odroid_input_event_t* input, int ticks)
+{
+    odroid_event_t event = {0};
+    event.type = ODROID_EVENT_INPUT;
+    event.input = *input;
+
+    return odroid_event_post(&event, ticks);
+}
+
+// Must be called with input_lock held
+static void input_record_event(const odroid_input_event_t* event)
+{
+    if (record_events && record_count < record_capacity)
+    {
+        record_events[record_count++] = *event;
+    }
+}
+
+static void input_gpio_isr(void* arg)
+{
+    const input_pin_t* input = &digital_inputs[(int)arg];
+    const int64_t now = esp_timer_get_time();
+
+    // Sampling the level here (rather than trusting the edge) also filters out
+    // the short glitches GPIO39 sees whenever ADC1 is powered up.
+    uint8_t pressed = !gpio_get_level(input->pin);
+    bool changed = false;
+    odroid_input_event_t event;
+
+    // Level triggered with the polarity flipped on every call: behaves like an edge
+    // interrupt, but unlike edges a level can wake the chip from light sleep.
+    gpio_set_intr_type(input->pin, pressed ? GPIO_INTR_HIGH_LEVEL : GPIO_INTR_LOW_LEVEL);
+
+    portENTER_CRITICAL_ISR(&input_lock);
+
+    if (pressed != !!(gamepad_mask & ODROID_INPUT_BIT(input->button)) &&
+        now - last_change[input->button] >= INPUT_DEBOUNCE_US)
+    {
+        event = input_set_state(input->button, pressed, now);
+        changed = true;
+
+        if (replaying)
+        {
+            if (pressed) replaying = false;
+            changed = false;
+        }
+        else
+        {
+            input_record_event(&event);
+        }
+    }
+
+    portEXIT_CRITICAL_ISR(&input_lock);
+
+    if (changed)
+    {
+        odroid_event_t posted = {0};
+        posted.type = ODROID_EVENT_INPUT;
+        posted.input = event;
+
+        BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+        odroid_event_post_from_isr(&posted, &xHigherPriorityTaskWoken);
+        if (xHigherPriorityTaskWoken)
+            portYIELD_FROM_ISR();
+    }
+}
+
+uint16_t input_read_mask()
+{
+    if (!input_gamepad_initialized) abort();
+
+    return gamepad_mask;
+}
+
 void input_read(odroid_gamepad_state* out_state)
+{
+    uint16_t mask = input_read_mask();
+
+    for (int i = 0; i < ODROID_INPUT_MAX; ++i)
+    {
+        out_state->values[i] = (mask & ODROID_INPUT_BIT(i)) ? 1 : 0;
+    }
+}
+
+// Any event type. Presses handed out here count as answered for the latency histogram.
+// Events a modal screen set aside come first.
+bool input_wait_event(odroid_event_t* out_event, int ticks)
 {
     if (!input_gamepad_initialized) abort();
 
-    xSemaphoreTake(xSemaphore, portMAX_DELAY);
+    if (odroid_event_take_deferred(out_event))
+    {
+        return true;
+    }
+
+    if (!odroid_event_wait(out_event, ticks))
+    {
+        return false;
+    }
 
-    *out_state = gamepad_state;
+    if (out_event->type == ODROID_EVENT_INPUT && out_event->input.pressed)
+    {
+        odroid_latency_input(out_event->input.timestamp);
+    }
 
-    xSemaphoreGive(xSemaphore);
+    return true;
 }
 
-uint16_t wait_for_button_press(int ticks)
+bool input_event_pending()
 {
-    odroid_gamepad_state previousState;
-    input_read(&previousState);
+    return odroid_event_pending() > 0;
+}
 
-    int timeout = xTaskGetTickCount() + ticks;
-    //uint16_t btns = 0;
+// Input releases at the head of the queue are dropped, nothing acts on them.
+// Other event types are left alone and end the search.
+bool input_press_pending()
+{
+    odroid_event_t event;
+
+    while (odroid_event_peek(&event))
+    {
+        if (event.type != ODROID_EVENT_INPUT) break;
+        if (event.input.pressed) return true;
+        odroid_event_wait(&event, 0);
+    }
+
+    return false;
+}
+
+void input_set_repeat(const odroid_input_repeat_t* config)
+{
+    portENTER_CRITICAL(&input_lock);
+    repeat_config = *config;
+    portEXIT_CRITICAL(&input_lock);
+}
+
+// Drops the queued button events. Anything else is set aside for the main loop.
+void input_flush_events()
+{
+    odroid_event_t event;
+
+    while (odroid_event_wait(&event, 0))
+    {
+        if (event.type != ODROID_EVENT_INPUT) odroid_event_defer(&event);
+    }
+}
+
+int wait_for_button_press(int ticks)
+{
+    TickType_t start = xTaskGetTickCount();
+    odroid_event_t event;
 
     while (true)
     {
-		odroid_gamepad_state state;
-		input_read(&state);
+        TickType_t wait = portMAX_DELAY;
 
-        for(int i = 0; i < ODROID_INPUT_MAX; i++)
+        if (ticks > 0)
         {
-            if (!previousState.values[i] && state.values[i]) {
-                //btns |= (1 << i);
-                return i;
-            }
+            TickType_t elapsed = xTaskGetTickCount() - start;
+            if (elapsed >= ticks) break;
+            wait = ticks - elapsed;
         }
 
-        //if (btns != 0) { we don't need multiple detection right now
-        //    return btns;
-        //}
+        if (!odroid_event_wait(&event, wait)) break;
 
-        if (ticks > 0 && timeout < xTaskGetTickCount()) {
-            break;
+        // Modal screens only want presses. Releases are dropped, other
+        // events are set aside for the main loop.
+        if (event.type == ODROID_EVENT_INPUT && event.input.pressed)
+        {
+            odroid_latency_input(event.input.timestamp);
+            return event.input.button;
         }
 
-        previousState = state;
-        vTaskDelay(10 / portTICK_PERIOD_MS);
+        if (event.type != ODROID_EVENT_INPUT) odroid_event_defer(&event);
     }
 
     return -1;
 }
 
+bool input_record_start(int capacity)
+{
+    if (replaying || record_events || capacity < 1) return false;
+
+    odroid_input_event_t* events = heap_caps_malloc(capacity * sizeof(odroid_input_event_t), MALLOC_CAP_SPIRAM);
+    if (!events)
+    {
+        events = malloc(capacity * sizeof(odroid_input_event_t));
+        if (!events) return false;
+    }
+
+    portENTER_CRITICAL(&input_lock);
+    record_count = 0;
+    record_capacity = capacity;
+    record_start = esp_timer_get_time();
+    record_events = events;
+    portEXIT_CRITICAL(&input_lock);
+
+    ESP_LOGI(__func__, "recording (%d events max).", capacity);
+    return true;
+}
+
+// Returns the recorded events with timestamps relative to the start, the caller frees them
+int input_record_stop(odroid_input_event_t** out_events)
+{
+    portENTER_CRITICAL(&input_lock);
+    odroid_input_event_t* events = record_events;
+    int count = record_count;
+    record_events = NULL;
+    portEXIT_CRITICAL(&input_lock);
+
+    if (!events) return -1;
+
+    for (int i = 0; i < count; ++i)
+    {
+        events[i].timestamp -= record_start;
+    }
+
+    ESP_LOGI(__func__, "%d events recorded.", count);
+
+    *out_events = events;
+    return count;
+}
+
+bool input_recording()
+{
+    return record_events != NULL;
+}
+
+static void input_replay_task(void *arg)
+{
+    const int64_t start = esp_timer_get_time();
+    int sent = 0;
+
+    while (replaying && sent < replay_count)
+    {
+        odroid_input_event_t event = replay_events[sent];
+        const int64_t due = start + event.timestamp;
+        int64_t now = esp_timer_get_time();
+
+        if (now < due)
+        {
+            TickType_t ticks = (due - now) / 1000 / portTICK_PERIOD_MS;
+            vTaskDelay(ticks > 0 ? ticks : 1);
+            continue;
+        }
+
+        // Nothing is dropped, if the UI falls behind the script waits for it
+        event.timestamp = now;
+        if (input_post_event(&event, 10 / portTICK_PERIOD_MS))
+        {
+            ++sent;
+        }
+    }
+
+    ESP_LOGI(__func__, "%s after %d/%d events, %lld ms.", replaying ? "done" : "aborted",
+        sent, replay_count, (esp_timer_get_time() - start) / 1000);
+
+    free(replay_events);
+    replay_events = NULL;
+    replaying = false;
+
+    vTaskDelete(NULL);
+}
+
+// Takes ownership of events, timestamps are relative to the start of the replay
+bool input_replay_start(odroid_input_event_t* events, int count)
+{
+    if (!input_gamepad_initialized) abort();
+
+    if (replaying || replay_events || record_events || count < 1)
+    {
+        free(events);
+        return false;
+    }
+
+    replay_events = events;
+    replay_count = count;
+    replaying = true;
+
+    xTaskCreatePinnedToCore(&input_replay_task, "input_replay", 1024 * 2, NULL, 5, NULL, 1);
+
+    ESP_LOGI(__func__, "replaying %d events.", count);
+    return true;
+}
+
+void input_replay_stop()
+{
+    replaying = false;
+}
+
+bool input_replaying()
+{
+    return replaying || replay_events != NULL;
+}
+
 static void input_task(void *arg)
 {
     input_task_is_running = true;
@@ -126,6 +439,9 @@ static void input_task(void *arg)
         debounce[i] = 0xff;
     }
 
+    odroid_gamepad_state previous = {0};
+    int64_t lastActivity = esp_timer_get_time();
+    bool idle = false;
 
     while(input_task_is_running)
     {
@@ -137,40 +453,135 @@ static void input_task(void *arg)
 
         // Read hardware
         odroid_gamepad_state state = input_read_raw();
+        const int64_t now = esp_timer_get_time();
 
-        // Debounce
-        xSemaphoreTake(xSemaphore, portMAX_DELAY);
+        // Debounce. This drives the joystick, for the buttons it only catches
+        // the rare edge the interrupt ignored because it fell in the debounce window.
+        odroid_input_event_t events[ODROID_INPUT_MAX * 2];
+        int eventCount = 0;
+
+        portENTER_CRITICAL(&input_lock);
 
         for(int i = 0; i < ODROID_INPUT_MAX; ++i)
 		{
+            if (state.values[i] != previous.values[i])
+            {
+                raw_since[i] = now;
+            }
+
             debounce[i] |= state.values[i] ? 1 : 0;
-            uint8_t val = debounce[i] & 0x03; //0x0f;
+            uint8_t val = debounce[i] & 0x03;
+            uint8_t current = (gamepad_mask & ODROID_INPUT_BIT(i)) ? 1 : 0;
+            uint8_t pressed = current;
+
             switch (val) {
                 case 0x00:
-                    gamepad_state.values[i] = 0;
+                    pressed = 0;
                     break;
 
-                case 0x03: //0x0f:
-                    gamepad_state.values[i] = 1;
+                case 0x03:
+                    pressed = 1;
                     break;
 
                 default:
                     // ignore
                     break;
             }
+
+            if (pressed != current && now - last_change[i] >= INPUT_DEBOUNCE_US)
+            {
+                // Raw transitions between two polls are only known to the ISR
+                int64_t timestamp = (raw_since[i] > last_change[i]) ? raw_since[i] : now;
+                events[eventCount++] = input_set_state(i, pressed, timestamp);
+            }
 		}
 
-        previous_gamepad_state = gamepad_state;
+        // Auto-repeat, measured from the accepted press
+        const uint16_t mask = gamepad_mask;
+        for (int i = 0; i < ODROID_INPUT_MAX; ++i)
+        {
+            if (!(repeat_config.mask & mask & ODROID_INPUT_BIT(i)))
+            {
+                repeat_next[i] = 0;
+                repeat_count[i] = 0;
+            }
+            else if (repeat_next[i] == 0)
+            {
+                repeat_next[i] = last_change[i] + repeat_config.delay_ms * 1000;
+            }
+            else if (now >= repeat_next[i])
+            {
+                odroid_input_event_t event = {i, 1, 1, now};
+                events[eventCount++] = event;
+
+                int interval = (++repeat_count[i] >= repeat_config.accelerate_after) ?
+                    repeat_config.fast_interval_ms : repeat_config.interval_ms;
+                repeat_next[i] = now + interval * 1000;
+            }
+        }
+
+        if (replaying)
+        {
+            for (int i = 0; i < eventCount; ++i)
+            {
+                if (events[i].pressed) replaying = false;
+            }
+            eventCount = 0;
+        }
+
+        for (int i = 0; i < eventCount; ++i)
+        {
+            input_record_event(&events[i]);
+        }
 
-        xSemaphoreGive(xSemaphore);
+        portEXIT_CRITICAL(&input_lock);
 
-        // delay
-        vTaskDelay(10 / portTICK_PERIOD_MS);
+        for (int i = 0; i < eventCount; ++i)
+        {
+            input_post_event(&events[i], 0);
+        }
+
+        // Presses handled by the ISR alone only show up in last_change
+        int64_t latest = 0;
+        for (int i = 0; i < ODROID_INPUT_MAX; ++i)
+        {
+            if (last_change[i] > latest) latest = last_change[i];
+        }
+
+        if (eventCount > 0 || latest > lastActivity)
+        {
+            lastActivity = now;
+            odroid_power_activity();
+        }
+        else if (mask != 0)
+        {
+            lastActivity = now;
+        }
+
+        // Poll the joystick slower once nothing has happened for a while
+        bool nowIdle = (now - lastActivity) > INPUT_IDLE_AFTER_US;
+        if (nowIdle != idle)
+        {
+            idle = nowIdle;
+            uint16_t period = idle ? INPUT_IDLE_POLL_PERIOD_MS : INPUT_POLL_PERIOD_MS;
+            odroid_adc_set_period(joystick_x, period);
+            odroid_adc_set_period(joystick_y, period);
+        }
+
+        previous = state;
+
+        // Woken by the ADC service once the joystick has been sampled
+        ulTaskNotifyTake(pdTRUE, (INPUT_IDLE_POLL_PERIOD_MS * 2) / portTICK_PERIOD_MS);
     }
 
     input_gamepad_initialized = false;
 
-    vSemaphoreDelete(xSemaphore);
+    for (int i = 0; i < DIGITAL_INPUT_COUNT; ++i)
+    {
+        gpio_isr_handler_remove(digital_inputs[i].pin);
+    }
+
+    input_task_handle = NULL;
 
     // Remove the task from scheduler
     vTaskDelete(NULL);
@@ -179,15 +590,14 @@ static void input_task(void *arg)
     while (1) { vTaskDelay(1);}
 }
 
-void input_init()
+static void input_adc_sampled(int handle, uint16_t value, int64_t timestamp)
 {
-    xSemaphore = xSemaphoreCreateMutex();
+    if (input_task_handle) xTaskNotifyGive(input_task_handle);
+}
 
-    if(xSemaphore == NULL)
-    {
-        ESP_LOGE(__func__, "xSemaphoreCreateMutex failed.");
-        abort();
-    }
+void input_init()
+{
+    odroid_event_init();
 
 	gpio_set_direction(ODROID_GAMEPAD_IO_SELECT, GPIO_MODE_INPUT);
 	gpio_set_pull_mode(ODROID_GAMEPAD_IO_SELECT, GPIO_PULLUP_ONLY);
@@ -200,19 +610,42 @@ void input_init()
     gpio_set_direction(ODROID_GAMEPAD_IO_B, GPIO_MODE_INPUT);
 	gpio_set_pull_mode(ODROID_GAMEPAD_IO_B, GPIO_PULLUP_ONLY);
 
-	adc1_config_width(ADC_WIDTH_12Bit);
-    adc1_config_channel_atten(ODROID_GAMEPAD_IO_X, ADC_ATTEN_11db);
-	adc1_config_channel_atten(ODROID_GAMEPAD_IO_Y, ADC_ATTEN_11db);
+    // Unfiltered, the thresholds already ignore noise. Y comes second and wakes the input task.
+    joystick_x = odroid_adc_add_channel(ODROID_GAMEPAD_IO_X, ADC_ATTEN_11db, INPUT_POLL_PERIOD_MS, 0, NULL);
+    joystick_y = odroid_adc_add_channel(ODROID_GAMEPAD_IO_Y, ADC_ATTEN_11db, INPUT_POLL_PERIOD_MS, 0, &input_adc_sampled);
 
 	gpio_set_direction(ODROID_GAMEPAD_IO_MENU, GPIO_MODE_INPUT);
 	gpio_set_pull_mode(ODROID_GAMEPAD_IO_MENU, GPIO_PULLUP_ONLY);
 
 	gpio_set_direction(ODROID_GAMEPAD_IO_VOLUME, GPIO_MODE_INPUT);
 
+    // The ISR service may already be installed by someone else
+    esp_err_t ret = gpio_install_isr_service(0);
+    if (ret != ESP_OK && ret != ESP_ERR_INVALID_STATE)
+    {
+        ESP_LOGE(__func__, "gpio_install_isr_service failed (%d)", ret);
+        abort();
+    }
+
+    // Buttons that are already held at boot (B to enter this menu) must not generate a press
+    odroid_gamepad_state state = input_read_raw();
+    for (int i = 0; i < DIGITAL_INPUT_COUNT; ++i)
+    {
+        if (state.values[digital_inputs[i].button])
+            gamepad_mask |= ODROID_INPUT_BIT(digital_inputs[i].button);
+    }
+
+    for (int i = 0; i < DIGITAL_INPUT_COUNT; ++i)
+    {
+        bool held = state.values[digital_inputs[i].button];
+        gpio_wakeup_enable(digital_inputs[i].pin, held ? GPIO_INTR_HIGH_LEVEL : GPIO_INTR_LOW_LEVEL);
+        gpio_isr_handler_add(digital_inputs[i].pin, &input_gpio_isr, (void*)i);
+    }
+
     input_gamepad_initialized = true;
 
     // Start background polling
-    xTaskCreatePinnedToCore(&input_task, "input_task", 1024 * 2, NULL, 5, NULL, 1);
+    xTaskCreatePinnedToCore(&input_task, "input_task", 1024 * 2, NULL, 5, &input_task_handle, 1);
 
   	ESP_LOGI(__func__, "done.");
 }
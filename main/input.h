@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
 
 
 #define ODROID_GAMEPAD_IO_X ADC1_CHANNEL_6
@@ -29,13 +30,46 @@ enum
 	ODROID_INPUT_MAX
 };
 
+#define ODROID_INPUT_BIT(button) (1 << (button))
+
 typedef struct
 {
     uint8_t values[ODROID_INPUT_MAX];
 } odroid_gamepad_state;
 
+typedef struct
+{
+    uint8_t button;
+    uint8_t pressed;
+    uint8_t repeat; // generated by auto-repeat while held
+    int64_t timestamp; // esp_timer_get_time() of the raw transition
+} odroid_input_event_t;
+
+typedef struct
+{
+    uint16_t mask; // ODROID_INPUT_BIT() of the buttons that repeat
+    uint16_t delay_ms; // hold time before the first repeat
+    uint16_t interval_ms;
+    uint16_t accelerate_after; // repeats before switching to fast_interval_ms
+    uint16_t fast_interval_ms;
+} odroid_input_repeat_t;
+
+struct odroid_event;
+
 
 void input_init();
 void input_read(odroid_gamepad_state* out_state);
-uint16_t wait_for_button_press();
+uint16_t input_read_mask();
+int wait_for_button_press(int ticks);
+bool input_wait_event(struct odroid_event* out_event, int ticks);
+bool input_event_pending();
+bool input_press_pending();
+void input_set_repeat(const odroid_input_repeat_t* config);
+void input_flush_events();
+bool input_record_start(int capacity);
+int input_record_stop(odroid_input_event_t** out_events);
+bool input_recording();
+bool input_replay_start(odroid_input_event_t* events, int count);
+void input_replay_stop();
+bool input_replaying();
 odroid_gamepad_state input_read_raw();
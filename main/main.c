@@ -1,5 +1,6 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
 #include "esp_wifi.h"
 #include "esp_system.h"
 #include "esp_event.h"
@@ -7,13 +8,12 @@
 #include "nvs_flash.h"
 #include "nvs.h"
 #include "driver/gpio.h"
-#include "driver/adc.h"
-#include "esp_adc_cal.h"
 #include "esp_partition.h"
 #include "esp_ota_ops.h"
 #include "esp_heap_caps.h"
 #include "esp_flash_data_types.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "rom/crc.h"
 
 #include <string.h>
@@ -23,6 +23,17 @@
 
 #include "odroid_sdcard.h"
 #include "odroid_display.h"
+#include "odroid_jpeg.h"
+#include "odroid_battery.h"
+#include "odroid_log.h"
+#include "odroid_latency.h"
+#include "odroid_input_script.h"
+#include "odroid_event.h"
+#include "odroid_power.h"
+#include "odroid_initials.h"
+#include "odroid_fwindex.h"
+#include "odroid_cache.h"
+#include "odroid_spibus.h"
 #include "input.h"
 
 #include "../components/ugui/ugui.h"
@@ -54,6 +65,10 @@
 
 #define FLASH_SIZE (16 * 1024 * 1024)
 #define FLASH_BLOCK_SIZE (64 * 1024)
+#define FLASH_STREAM_BUFFERS (4)
+#define FLASH_STREAM_BUFFER_SIZE (16 * 1024)
+#define PROGRESS_UPDATE_MS (250)
+#define FLASH_WRITER_STACK_SIZE (1024 * 4)
 #define ERASE_BLOCK_SIZE (4 * 1024)
 
 #define APP_NVS_SIZE 0x3000
@@ -65,16 +80,27 @@
 #define FIRMWARE_PARTS_MAX (20)
 #define FIRMWARE_TILE_SIZE (TILE_WIDTH * TILE_HEIGHT)
 
-#define BATTERY_VMAX 420
-#define BATTERY_VMIN 330
 
 #define ITEM_COUNT (4)
 
+#define LOG_VIEW_TOP (16)
+#define LOG_VIEW_LINES ((240 - 16 * 2) / 8) // 26
+#define LOG_VIEW_COLUMNS (320 / 8) // 40
+
+#define INPUT_RECORD_CAPACITY (16 * 1024)
+
+#define JOB_FWINDEX (1)
+#define JOB_SDCARD (2)
+
+#define FW_CACHE_CAPACITY (16)
+#define FW_CACHE_FULL (1) // firmware_get_info() result
+
 #define LED_ON() gpio_set_level(GPIO_NUM_2, 1);
 #define LED_OFF() gpio_set_level(GPIO_NUM_2, 0);
 
 const char* SD_CARD = "/sd";
 const char* FIRMWARE_PATH = "/sd/odroid/firmware";
+const char* INPUT_SCRIPT_PATH = "/sd/odroid/input_script.txt";
 
 //const char* HEADER = "ODROIDGO_FIRMWARE_V00_00";
 const char* HEADER_V00_01 = "ODROIDGO_FIRMWARE_V00_01";
@@ -151,6 +177,7 @@ static int apps_count = -1;
 static int apps_max = 4;
 static int nextInstallSeq = 0;
 static int displayOrder = 0;
+static odroid_initials_t appInitials;
 
 static esp_partition_info_t* partition_data;
 static int partition_count = -1;
@@ -158,52 +185,24 @@ static int startTableEntry = -1;
 static int startFlashAddress = -1;
 
 static odroid_fw_t *fwInfoBuffer;
+static odroid_cache_t *fwCache;
+static odroid_fwindex_t catalog;
 static uint8_t *dataBuffer;
 
 static uint16_t fb[320 * 240];
 static UG_GUI gui;
 static char tempstring[512];
 
-static esp_err_t sdcardret;
 
 static nvs_handle nvs_h;
 
 static int batteryPercent = 0;
 
 
-static void battery_task(void *arg)
+static void battery_changed(int percent)
 {
-    // Some of that code is from Odroid GO Arduino library. Added rolling average for better results
-    esp_adc_cal_characteristics_t adc_cal;
-    adc1_config_width(ADC_WIDTH_BIT_12);
-    adc1_config_channel_atten(ADC1_CHANNEL_0, ADC_ATTEN_DB_11);
-    esp_adc_cal_characterize(ADC_UNIT_1, ADC_ATTEN_DB_11, ADC_WIDTH_BIT_12, 1100, &adc_cal);
-
-    const int count = 128;
-    uint32_t samples[count];
-    uint32_t loops = 0;
-
-    while(1)
-    {
-        samples[loops % count] = adc1_get_raw((adc1_channel_t) ADC1_CHANNEL_0);
-
-        uint32_t total = 0;
-        for (int i = 0; i < count; i++)
-        {
-            total += samples[i];
-        }
-
-        double voltage = (double) esp_adc_cal_raw_to_voltage(total / count, &adc_cal) * 2 / 1000;
-
-        batteryPercent = 101 - (101 / pow(1 + pow(1.33 * ((int)(voltage * 100) - BATTERY_VMIN)
-                                                            / (BATTERY_VMAX - BATTERY_VMIN), 4.5), 3));
-
-        if (batteryPercent >= 100)
-            batteryPercent = 100;
-
-        if (++loops > count)
-            vTaskDelay(25);
-    }
+    batteryPercent = percent;
+    odroid_event_post_data(ODROID_EVENT_BATTERY, 0, percent);
 }
 
 
@@ -224,6 +223,8 @@ static void pset(UG_S16 x, UG_S16 y, UG_COLOR color)
 
 static void ui_update_display()
 {
+    // Tag the frame with the press it answers, if any
+    ili9341_set_frame_timestamp(odroid_latency_take());
     ili9341_write_frame_rectangleLE(0, 0, 320, 240, fb);
 }
 
@@ -309,6 +310,25 @@ static void DisplayProgress(int percent)
     //UpdateDisplay();
 }
 
+// Pushes the progress bar at most every PROGRESS_UPDATE_MS. Each push is a
+// full frame on the bus the install is streaming from.
+static void DisplayProgressUpdate(int percent)
+{
+    static int64_t lastUpdate = 0;
+    static int lastPercent = -1;
+
+    int64_t now = esp_timer_get_time();
+
+    if (percent == lastPercent) return;
+    if (now - lastUpdate < PROGRESS_UPDATE_MS * 1000 && percent < 100) return;
+
+    lastPercent = percent;
+    lastUpdate = now;
+
+    DisplayProgress(percent);
+    UpdateDisplay();
+}
+
 static void DisplayFooter(char* message)
 {
     UG_FontSelect(&FONT_8X12);
@@ -357,7 +377,9 @@ void cleanup_and_restart()
     ili9341_clear(0x0000);
     ili9341_deinit();
 
-    // Close SD card
+    // Stop the indexer before the card goes away under it, then close the
+    // card (waits for a background mount still running)
+    odroid_fwindex_close(&catalog);
     odroid_sdcard_close();
 
     // Close NVS
@@ -409,6 +431,11 @@ static int sort_app_table_by_alphabet(const void * a, const void * b)
     return strcasecmp((*(odroid_app_t*)a).description, (*(odroid_app_t*)b).description);
 }
 
+static const char* app_initials_name(void* arg, int index)
+{
+    return apps[index].description;
+}
+
 static void sort_app_table(int newMode)
 {
     switch(newMode & ~1) {
@@ -437,6 +464,8 @@ static void sort_app_table(int newMode)
         }
         free(tmp);
     }
+
+    odroid_initials_build(&appInitials, apps_count, &app_initials_name, NULL);
 }
 
 
@@ -637,6 +666,8 @@ void defrag_flash()
     size_t totalBytesToMove = 0;
     size_t totalBytesMoved = 0;
 
+    odroid_power_performance_begin();
+
     sort_app_table(APP_SORT_OFFSET);
 
     // First loop to get total for the progress bar
@@ -691,6 +722,8 @@ void defrag_flash()
     }
 
     write_app_table();
+
+    odroid_power_performance_end();
 }
 
 
@@ -747,7 +780,7 @@ int find_free_block(size_t size, bool defragIfNeeded)
         }
     }
 
-    if (result < 0 && totalFreeSpace >= size) {
+    if (result < 0 && defragIfNeeded && totalFreeSpace >= size) {
         defrag_flash();
         result = find_free_block(size, false);
     }
@@ -845,192 +878,341 @@ firmware_get_info_err:
 }
 
 
-void flash_utility()
+// Parsed headers are cached by path, size and date. Returns NULL if the file
+// is not valid firmware. The result must not be modified.
+static const odroid_fw_t* firmware_get_info_cached(const char* path, uint32_t size, uint32_t mtime)
 {
-    // Code to flash utility.bin.
-    // Because leaving it in flash_firmware results in multiple copies being flashed.
-    //FILE* util = fopen("/sd/odroid/utility.bin", "rb");
-    //util_part.type = ESP_PARTITION_TYPE_APP;
-    //util_part.subtype = ESP_PARTITION_SUBTYPE_APP_TEST;
-}
+    uint8_t tag = 0;
+    odroid_fw_t* fw = odroid_cache_get(fwCache, path, size, mtime, &tag);
 
+    if (fw && tag == FW_CACHE_FULL) return fw;
 
-void flash_firmware(const char* fullPath)
+    fw = odroid_cache_put(fwCache, path, size, mtime, FW_CACHE_FULL);
+    if (!fw) fw = fwInfoBuffer;
+
+    if (!firmware_get_info(path, fw))
+    {
+        odroid_cache_drop(fwCache, path);
+        return NULL;
+    }
+
+    return fw;
+}
+
+// Parsed header of a catalog item for the browser and installs. Comes from
+// the cache, or else from the catalog's copy without opening the .fw itself.
+// NULL for files that are invalid or not indexed yet.
+static const odroid_fw_t* firmware_get_catalog_info(odroid_fwindex_t* index, int item)
 {
-    ESP_LOGD(__func__, "HEAP=%#010x", esp_get_free_heap_size());
-    LED_OFF();
+    odroid_fwindex_entry_t* entry = &index->entries[item];
 
-    size_t count;
-    bool can_proceed = true;
+    if (entry->pending || !entry->valid) return NULL;
 
-    sort_app_table(APP_SORT_OFFSET);
+    sprintf(tempstring, "%s/%s", index->path, index->names[item]);
 
-    ui_draw_title("Install Application", "Destination: Pending");
-    UpdateDisplay();
+    odroid_fw_t* fw = odroid_cache_get(fwCache, tempstring, entry->fileSize, entry->mtime, NULL);
+    if (fw) return fw;
 
-    ESP_LOGI(__func__, "Flashing file: %s", fullPath);
+    fw = odroid_cache_put(fwCache, tempstring, entry->fileSize, entry->mtime, FW_CACHE_FULL);
+    if (!fw) fw = fwInfoBuffer;
 
-    FILE* file = fopen(fullPath, "rb");
-    if (file == NULL)
+    if (!odroid_fwindex_read_detail(index, item, fw))
     {
-        DisplayError("FILE OPEN ERROR");
-        indicate_error();
+        odroid_cache_drop(fwCache, tempstring);
+        return NULL;
     }
 
-    odroid_fw_t *fw = fwInfoBuffer;
+    return fw;
+}
 
-    if (!firmware_get_info(fullPath, fw))
+// Catalog probe, the whole parsed header is kept as the detail record so
+// that installs don't parse the file again. Runs on the indexer task.
+static bool firmware_get_index_entry(const char* path, odroid_fwindex_entry_t* entry, void* detail)
+{
+    odroid_fw_t* fw = (odroid_fw_t*)detail;
+
+    bool valid = firmware_get_info(path, fw);
+
+    if (valid)
     {
-        // To do: Make it show what is invalid
-        DisplayError("INVALID FIRMWARE FILE");
-        can_proceed = false;
+        strncpy(entry->description, fw->fileHeader.description, ODROID_FWINDEX_DESCRIPTION_SIZE - 1);
+        entry->flashSize = fw->flashSize;
+        entry->partsCount = fw->parts_count;
+        entry->checksum = fw->checksum;
     }
 
-    int currentFlashAddress = find_free_block(fw->flashSize, true);
+    return valid;
+}
 
-    odroid_app_t *app = &apps[apps_count];
-    memset(app, 0x00, sizeof(odroid_app_t));
 
-    strncpy(app->description, fw->fileHeader.description, FIRMWARE_DESCRIPTION_SIZE-1);
-    strncpy(app->filename, strrchr(fullPath, '/'), FIRMWARE_DESCRIPTION_SIZE-1);
-    memcpy(app->tile, fw->fileHeader.tile, FIRMWARE_TILE_SIZE * 2);
-    memcpy(app->parts, fw->parts, sizeof(app->parts));
-    app->parts_count = fw->parts_count;
+void flash_utility()
+{
+    // Code to flash utility.bin.
+    // Because leaving it in flash_firmware results in multiple copies being flashed.
+    //FILE* util = fopen("/sd/odroid/utility.bin", "rb");
+    //util_part.type = ESP_PARTITION_TYPE_APP;
+    //util_part.subtype = ESP_PARTITION_SUBTYPE_APP_TEST;
+}
 
-    ESP_LOGI(__func__, "Destination: 0x%x", currentFlashAddress);
-    ESP_LOGI(__func__, "Description: '%s'", app->description);
 
-    sprintf(tempstring, "Destination: 0x%x", currentFlashAddress);
-    ui_draw_title("Install Application", tempstring);
-    DisplayHeader(app->description);
-    DisplayTile(app->tile);
+// Reads up to max bytes of the install stream, folding them into the checksum
+static int flash_stream_read(odroid_sdcard_stream_t* stream, size_t max, const uint8_t** out_data, uint32_t* checksum)
+{
+    int count = odroid_sdcard_stream_read(stream, max, out_data);
+    if (count > 0) *checksum = crc32_le(*checksum, *out_data, count);
+
+    return count;
+}
+
+static bool flash_stream_skip(odroid_sdcard_stream_t* stream, size_t length, uint32_t* checksum)
+{
+    const uint8_t* data;
 
-    if (currentFlashAddress == -1)
+    while (length > 0)
     {
-        DisplayError("NOT ENOUGH FREE SPACE");
-        can_proceed = false;
+        int count = flash_stream_read(stream, length, &data, checksum);
+        if (count <= 0) return false;
+
+        length -= count;
     }
 
-    if (can_proceed)
+    return true;
+}
+
+// The install runs as a pipeline: the stream's reader task fills buffers from
+// SD on core 1 while this task checksums them and programs flash on core 0.
+// The UI only follows along through a one slot mailbox that always holds the
+// latest state, so a slow frame never holds up the copy.
+typedef struct
+{
+    int8_t part;
+    bool erasing;
+    bool done;
+    uint8_t percent;
+    const char* error;
+} flash_progress_t;
+
+typedef struct
+{
+    odroid_sdcard_stream_t* stream;
+    odroid_app_t* app;
+    size_t dataOffset;
+    int flashAddress; // start, then end once done
+    uint32_t checksum;
+    QueueHandle_t progress;
+    volatile bool exited;
+
+    // Update in place
+    bool update;
+    uint32_t keepParts; // empty partitions left as they are, e.g. the app's NVS
+    uint8_t* sector;
+    spi_flash_mmap_handle_t mapHandle;
+    const uint8_t* mapData;
+    int mapBase;
+    int sectorsWritten;
+    int sectorsKept;
+} flash_job_t;
+
+// Update in place only touches the sectors that changed. The current content
+// is read through a 64K mapped window rather than copied out, and compared
+// exactly: a hash would cost the same flash read.
+static const uint8_t* flash_map_sector(flash_job_t* job, int address)
+{
+    int base = address & ~(FLASH_BLOCK_SIZE - 1);
+
+    if (!job->mapData || job->mapBase != base)
     {
-        DisplayMessage("[START]");
+        if (job->mapData) spi_flash_munmap(job->mapHandle);
+        job->mapData = NULL;
+
+        const void* ptr;
+        if (spi_flash_mmap(base, FLASH_BLOCK_SIZE, SPI_FLASH_MMAP_DATA, &ptr, &job->mapHandle) != ESP_OK)
+        {
+            ESP_LOGW(__func__, "spi_flash_mmap failed. address=%#08x", base);
+            return NULL;
+        }
+
+        job->mapData = ptr;
+        job->mapBase = base;
     }
 
-    DisplayFooter("[B] Cancel");
+    return job->mapData + (address - base);
+}
 
-    while (1) {
-        int btn = wait_for_button_press(-1);
+static const char* flash_update_part(flash_job_t* job, const odroid_partition_t* slot, flash_progress_t* progress)
+{
+    const uint8_t* data;
 
-        if (btn == ODROID_INPUT_START && can_proceed) break;
-        if (btn == ODROID_INPUT_B)
+    int eraseBlocks = slot->length / ERASE_BLOCK_SIZE;
+    if (eraseBlocks * ERASE_BLOCK_SIZE < slot->length) ++eraseBlocks;
+
+    for (int block = 0; block < eraseBlocks; ++block)
+    {
+        int offset = block * ERASE_BLOCK_SIZE;
+        int address = job->flashAddress + offset;
+
+        if (offset % FLASH_BLOCK_SIZE == 0)
         {
-            fclose(file);
-            return;
+            ESP_LOGI(__func__, "Updating (%d) at %#08x", progress->part, offset);
+            progress->percent = (uint64_t)block * 100 / eraseBlocks;
+            xQueueOverwrite(job->progress, progress);
         }
-    }
 
-    LED_ON();
+        // What a full install would leave in this sector: data, then erased bytes
+        int length = 0;
+        if (slot->dataLength > offset)
+        {
+            length = slot->dataLength - offset;
+            if (length > ERASE_BLOCK_SIZE) length = ERASE_BLOCK_SIZE;
+        }
 
-    DisplayMessage("Verifying ...");
-    DisplayFooter("");
+        int filled = 0;
+        while (filled < length)
+        {
+            int count = flash_stream_read(job->stream, length - filled, &data, &job->checksum);
+            if (count <= 0) return "DATA READ ERROR";
 
+            memcpy(job->sector + filled, data, count);
+            filled += count;
+        }
 
-    // Verify file integerity
-    ESP_LOGI(__func__, "Expected checksum: %#010x",fw->checksum);
+        memset(job->sector + length, 0xff, ERASE_BLOCK_SIZE - length);
 
-    fseek(file, 0, SEEK_SET);
+        const uint8_t* current = flash_map_sector(job, address);
+        if (current && memcmp(current, job->sector, ERASE_BLOCK_SIZE) == 0)
+        {
+            job->sectorsKept++;
+            continue;
+        }
 
-    uint32_t checksum = 0;
-    while(true)
-    {
-        count = fread(dataBuffer, 1, FLASH_BLOCK_SIZE, file);
-        if (ftell(file) == fw->fileSize)
+        LED_ON();
+
+        if (spi_flash_erase_range(address, ERASE_BLOCK_SIZE) != ESP_OK)
+        {
+            ESP_LOGE(__func__, "spi_flash_erase_range failed. address=%#08x", address);
+            LED_OFF();
+            return "ERASE ERROR";
+        }
+
+        if (length > 0 && spi_flash_write(address, job->sector, length) != ESP_OK)
         {
-            count -= 4;
+            ESP_LOGE(__func__, "spi_flash_write failed. address=%#08x", address);
+            LED_OFF();
+            return "WRITE ERROR";
         }
 
-        checksum = crc32_le(checksum, dataBuffer, count);
+        LED_OFF();
 
-        if (count < FLASH_BLOCK_SIZE) break;
+        job->sectorsWritten++;
     }
 
-    ESP_LOGI(__func__, "Computed checksum: %#010x", checksum);
+    return NULL;
+}
 
-    if (checksum != fw->checksum)
+static void flash_write_task(void* arg)
+{
+    flash_job_t* job = (flash_job_t*)arg;
+    odroid_app_t* app = job->app;
+    flash_progress_t progress = {0};
+    const uint8_t* data;
+    int count;
+
+    // File header and description, firmware_get_info prepared everything for us
+    if (!flash_stream_skip(job->stream, job->dataOffset, &job->checksum))
     {
-        DisplayError("CHECKSUM MISMATCH ERROR");
-        indicate_error();
+        progress.error = "DATA READ ERROR";
+        goto flash_write_done;
     }
 
-    // restore location to end of description
-    fseek(file, fw->dataOffset, SEEK_SET);
-
-    app->magic = APP_MAGIC;
-    app->startOffset = currentFlashAddress;
-
     // Copy the firmware
     for (int i = 0; i < app->parts_count; i++)
     {
         odroid_partition_t *slot = &app->parts[i];
 
-        // Skip header, firmware_get_info prepared everything for us
-        fseek(file, sizeof(odroid_partition_t), SEEK_CUR);
+        // Skip header
+        if (!flash_stream_skip(job->stream, sizeof(odroid_partition_t), &job->checksum))
+        {
+            progress.error = "DATA READ ERROR";
+            goto flash_write_done;
+        }
+
+        if (job->keepParts & (1 << i))
+        {
+            ESP_LOGI(__func__, "Partition(%d): kept. Length=%#08x", i, slot->length);
+            job->flashAddress += slot->length;
+            continue;
+        }
+
+        if (job->update)
+        {
+            progress.part = i;
+            progress.erasing = false;
+            progress.percent = 0;
+            xQueueOverwrite(job->progress, &progress);
+
+            progress.error = flash_update_part(job, slot, &progress);
+            if (progress.error) goto flash_write_done;
+
+            ESP_LOGI(__func__, "Partition(%d): OK. Length=%#08x", i, slot->length);
+            job->flashAddress += slot->length;
+            continue;
+        }
 
         LED_OFF();
 
         // Erase target partition space
         ESP_LOGI(__func__, "Erasing ... (%d)", i);
-        sprintf(tempstring, "Erasing ... (%d/%d)", i+1, app->parts_count);
-        DisplayProgress(0);
-        DisplayMessage(tempstring);
+        progress.part = i;
+        progress.erasing = true;
+        progress.percent = 0;
+        xQueueOverwrite(job->progress, &progress);
 
         int eraseBlocks = slot->length / ERASE_BLOCK_SIZE;
         if (eraseBlocks * ERASE_BLOCK_SIZE < slot->length) ++eraseBlocks;
 
-        esp_err_t ret = spi_flash_erase_range(currentFlashAddress, eraseBlocks * ERASE_BLOCK_SIZE);
+        esp_err_t ret = spi_flash_erase_range(job->flashAddress, eraseBlocks * ERASE_BLOCK_SIZE);
         if (ret != ESP_OK)
         {
             ESP_LOGE(__func__, "spi_flash_erase_range failed. eraseBlocks=%d", eraseBlocks);
-            DisplayError("ERASE ERROR");
-            indicate_error();
+            progress.error = "ERASE ERROR";
+            goto flash_write_done;
         }
 
         if (slot->dataLength > 0)
         {
-            size_t nextEntry = ftell(file) + slot->dataLength;
-
             LED_ON();
 
-            // Write data
+            progress.erasing = false;
+            xQueueOverwrite(job->progress, &progress);
+
+            // Write data straight from the stream buffers
             int totalCount = 0;
-            for (int offset = 0; offset < slot->dataLength; offset += FLASH_BLOCK_SIZE)
+            int nextProgress = 0;
+            while (totalCount < slot->dataLength)
             {
-                ESP_LOGI(__func__, "Writing (%d) at %#08x", i, offset);
-
-                sprintf(tempstring, "Writing (%d/%d)", i+1, app->parts_count);
-                DisplayProgress((float)offset / (float)(slot->dataLength - FLASH_BLOCK_SIZE) * 100.0f);
-                DisplayMessage(tempstring);
-
-                // read
-                count = fread(dataBuffer, 1, FLASH_BLOCK_SIZE, file);
-                if (count <= 0)
+                if (totalCount >= nextProgress)
                 {
-                    DisplayError("DATA READ ERROR");
-                    indicate_error();
+                    ESP_LOGI(__func__, "Writing (%d) at %#08x", i, totalCount);
+                    nextProgress += FLASH_BLOCK_SIZE;
+
+                    progress.percent = (uint64_t)totalCount * 100 / slot->dataLength;
+                    xQueueOverwrite(job->progress, &progress);
                 }
 
-                if (offset + count >= slot->dataLength)
+                count = flash_stream_read(job->stream, slot->dataLength - totalCount, &data, &job->checksum);
+                if (count <= 0)
                 {
-                    count = slot->dataLength - offset;
+                    progress.error = "DATA READ ERROR";
+                    goto flash_write_done;
                 }
 
                 // flash
-                ret = spi_flash_write(currentFlashAddress + offset, dataBuffer, count);
+                ret = spi_flash_write(job->flashAddress + totalCount, data, count);
                 if (ret != ESP_OK)
         		{
-        			ESP_LOGE(__func__, "spi_flash_write failed. address=%#08x", currentFlashAddress + offset);
-                    DisplayError("WRITE ERROR");
-                    indicate_error();
+        			ESP_LOGE(__func__, "spi_flash_write failed. address=%#08x", job->flashAddress + totalCount);
+                    progress.error = "WRITE ERROR";
+                    goto flash_write_done;
         		}
 
                 totalCount += count;
@@ -1041,163 +1223,599 @@ void flash_firmware(const char* fullPath)
             if (totalCount != slot->dataLength)
             {
                 ESP_LOGE(__func__, "Size mismatch: length=%#08x, totalCount=%#08x", slot->dataLength, totalCount);
-                DisplayError("DATA SIZE ERROR");
-                indicate_error();
+                progress.error = "DATA SIZE ERROR";
+                goto flash_write_done;
             }
-
-            fseek(file, nextEntry, SEEK_SET);
-            // TODO: verify
         }
 
         // Notify OK
         ESP_LOGI(__func__, "Partition(%d): OK. Length=%#08x", i, slot->length);
-        currentFlashAddress += slot->length;
+        job->flashAddress += slot->length;
     }
 
-    fclose(file);
-
-    // 64K align our endOffset
-    app->endOffset = ALIGN_ADDRESS(currentFlashAddress, 0x10000) - 1;
-
-    // Remember the install order, for display sorting
-    app->installSeq = nextInstallSeq++;
-
-    // Write app table
-    apps_count++; // Everything went well, acknowledge the new app
-    write_app_table();
-
-    DisplayMessage("Ready !");
-    DisplayFooter("[B] Go Back   |   [A] Boot");
+    // Whatever follows the last partition is covered by the checksum too
+    while ((count = flash_stream_read(job->stream, FLASH_STREAM_BUFFER_SIZE, &data, &job->checksum)) > 0);
 
-    while (1) {
-        int btn = wait_for_button_press(-1);
+    if (count < 0) progress.error = "DATA READ ERROR";
 
-        if (btn == ODROID_INPUT_A) break;
-        if (btn == ODROID_INPUT_B) return;
-    }
+flash_write_done:
+    if (job->mapData) spi_flash_munmap(job->mapHandle);
 
-    // Write partition table
-    write_partition_table(app->parts, app->parts_count, app->startOffset);
+    progress.done = true;
+    progress.percent = 100;
+    xQueueOverwrite(job->progress, &progress);
 
-    // boot firmware
-    boot_application();
+    job->exited = true;
+    vTaskDelete(NULL);
 }
 
-
-static void ui_draw_title(char* TITLE, char* FOOTER)
+static void firmware_stage_app(odroid_app_t* app, const odroid_fw_t* fw, const char* fullPath)
 {
-    UG_FillFrame(0, 0, 319, 239, C_WHITE);
-
-    // Header
-    UG_FillFrame(0, 0, 319, 15, C_MIDNIGHT_BLUE);
-    UG_FontSelect(&FONT_8X8);
-    const short titleLeft = (320 / 2) - (strlen(TITLE) * 9 / 2);
-    UG_SetForecolor(C_WHITE);
-    UG_SetBackcolor(C_MIDNIGHT_BLUE);
-    UG_PutString(titleLeft, 4, TITLE);
+    memset(app, 0x00, sizeof(odroid_app_t));
 
-    // Footer
-    UG_FontSelect(&FONT_8X8);
-    UG_SetBackcolor(C_MIDNIGHT_BLUE);
-    UG_SetForecolor(C_LIGHT_GRAY);
-    UG_FillFrame(0, 239 - 16, 319, 239, C_MIDNIGHT_BLUE);
-    const short footerLeft = (320 / 2) - (strlen(FOOTER) * 9 / 2);
-    UG_PutString(footerLeft, 240 - 4 - 8, FOOTER);
+    strncpy(app->description, fw->fileHeader.description, FIRMWARE_DESCRIPTION_SIZE-1);
+    strncpy(app->filename, strrchr(fullPath, '/'), FIRMWARE_DESCRIPTION_SIZE-1);
+    memcpy(app->tile, fw->fileHeader.tile, FIRMWARE_TILE_SIZE * 2);
+    memcpy(app->parts, fw->parts, sizeof(app->parts));
+    app->parts_count = fw->parts_count;
 }
 
-
-static void ui_draw_indicators(int page, int totalPages)
+// Latest install of the same file whose region can hold the new one
+static int find_installed_app(const char* fileName, size_t size)
 {
-    UG_FontSelect(&FONT_8X8);
-    UG_SetForecolor(0x8C51);
+    int result = -1;
 
-    // Page indicator
-    sprintf(tempstring, "%d/%d", page, totalPages);
-    UG_PutString(4, 4, tempstring);
+    for (int i = 0; i < apps_count; i++)
+    {
+        if (strncmp(apps[i].filename, fileName, FIRMWARE_DESCRIPTION_SIZE-1) != 0) continue;
+        if (apps[i].endOffset + 1 - apps[i].startOffset < size) continue;
 
-    // Battery indicator
-    sprintf(tempstring, "%d%%", batteryPercent);
-    UG_PutString(320 - (9 * strlen(tempstring)) - 4, 4, tempstring);
-}
+        if (result < 0 || apps[i].installSeq > apps[result].installSeq) result = i;
+    }
 
+    return result;
+}
 
-static void ui_draw_row(int line, char *line1, char* line2, uint16_t color, uint16_t *tile, bool selected)
+// Partitions the firmware leaves empty (NVS) keep their content on update, as
+// long as the layout up to them hasn't changed
+static uint32_t firmware_kept_parts(const odroid_app_t* installed, const odroid_fw_t* fw)
 {
-    const int innerHeight = 240 - (16 * 2); // 208
-    const int itemHeight = innerHeight / ITEM_COUNT; // 52
+    uint32_t result = 0;
 
-    const int rightWidth = (213); // 320 * (2.0 / 3.0)
-    const int leftWidth = 320 - rightWidth;
+    for (int i = 0; i < fw->parts_count && i < installed->parts_count; i++)
+    {
+        const odroid_partition_t* current = &installed->parts[i];
+        const odroid_partition_t* part = &fw->parts[i];
 
-    // Tile width = 86, height = 48 (16:9)
-    const short imageLeft = (leftWidth / 2) - (86 / 2);
-    const short textLeft = 320 - rightWidth;
+        if (current->type != part->type || current->subtype != part->subtype || current->length != part->length) break;
 
-    short top = 16 + (line * itemHeight) - 1;
+        if (part->dataLength == 0) result |= (1 << i);
+    }
 
-    UG_FontSelect(&FONT_8X12);
+    return result;
+}
 
-    UG_SetBackcolor(selected ? C_YELLOW : C_WHITE);
-    UG_FillFrame(0, top + 2, 319, top + itemHeight - 1 - 1, UG_GetBackcolor());
+void flash_firmware(const char* fullPath)
+{
+    ESP_LOGD(__func__, "HEAP=%#010x", esp_get_free_heap_size());
+    LED_OFF();
 
-    ui_draw_image(imageLeft, top + 2, TILE_WIDTH, TILE_HEIGHT, tile);
+    bool can_proceed = true;
 
-    UG_SetForecolor(C_BLACK);
-    UG_PutString(textLeft, top + 2 + 2 + 7, line1);
+    sort_app_table(APP_SORT_OFFSET);
 
-    UG_SetForecolor(color);
-    UG_PutString(textLeft, top + 2 + 2 + 23, line2);
-}
+    ui_draw_title("Install Application", "Destination: Pending");
+    UpdateDisplay();
 
+    ESP_LOGI(__func__, "Flashing file: %s", fullPath);
 
-static void ui_draw_page(char** files, int fileCount, int currentItem)
-{
-    int page = (currentItem / ITEM_COUNT) * ITEM_COUNT;
+    odroid_sdcard_file_info_t fileInfo = {0};
+    if (!odroid_sdcard_get_info(fullPath, &fileInfo))
+    {
+        DisplayError("FILE OPEN ERROR");
+        indicate_error();
+    }
 
-    odroid_flash_block_t *blocks;
-    size_t count, totalFreeSpace;
+    odroid_fw_t *fw = fwInfoBuffer;
 
-    find_free_blocks(&blocks, &count, &totalFreeSpace);
-    free(blocks);
+    // Usually parsed already by the catalog
+    const odroid_fw_t *cached = NULL;
+    int item = odroid_fwindex_find(&catalog, strrchr(fullPath, '/') + 1);
+    if (item >= 0 && strncmp(fullPath, catalog.path, strlen(catalog.path)) == 0)
+    {
+        cached = firmware_get_catalog_info(&catalog, item);
+    }
+
+    if (!cached)
+    {
+        cached = firmware_get_info_cached(fullPath, fileInfo.size, fileInfo.mtime);
+    }
+
+    if (cached)
+    {
+        if (cached != fw) memcpy(fw, cached, sizeof(odroid_fw_t));
+    }
+    else
+    {
+        // To do: Make it show what is invalid
+        DisplayError("INVALID FIRMWARE FILE");
+        can_proceed = false;
+    }
+
+    // An older install of the same file can be updated where it is, no need
+    // to defragment for a new copy then
+    int updateIndex = can_proceed ? find_installed_app(strrchr(fullPath, '/'), fw->flashSize) : -1;
+
+    int currentFlashAddress = find_free_block(fw->flashSize, updateIndex < 0);
+
+    odroid_app_t *app = &apps[apps_count];
+    firmware_stage_app(app, fw, fullPath);
+
+    ESP_LOGI(__func__, "Destination: 0x%x", currentFlashAddress);
+    ESP_LOGI(__func__, "Description: '%s'", app->description);
+
+    if (updateIndex >= 0)
+    {
+        ESP_LOGI(__func__, "Installed copy: 0x%x", apps[updateIndex].startOffset);
+    }
+
+    sprintf(tempstring, "Destination: 0x%x",
+        (currentFlashAddress == -1 && updateIndex >= 0) ? apps[updateIndex].startOffset : currentFlashAddress);
+    ui_draw_title("Install Application", tempstring);
+    DisplayHeader(app->description);
+    DisplayTile(app->tile);
+
+    if (currentFlashAddress == -1 && updateIndex < 0)
+    {
+        DisplayError("NOT ENOUGH FREE SPACE");
+        can_proceed = false;
+    }
+
+    if (can_proceed)
+    {
+        if (updateIndex < 0) DisplayMessage("[START]");
+        else if (currentFlashAddress == -1) DisplayMessage("[A] Update");
+        else DisplayMessage("[START] New copy   [A] Update");
+    }
+
+    DisplayFooter("[B] Cancel");
+
+    // Don't let key presses made while parsing confirm the install
+    input_flush_events();
+
+    bool update = false;
+
+    while (1) {
+        int btn = wait_for_button_press(-1);
+
+        if (btn == ODROID_INPUT_START && can_proceed && currentFlashAddress != -1) break;
+        if (btn == ODROID_INPUT_A && can_proceed && updateIndex >= 0) { update = true; break; }
+        if (btn == ODROID_INPUT_B) return;
+    }
+
+    LED_ON();
+
+    // Full speed until the app is written, light sleep can't happen while busy anyway
+    odroid_power_performance_begin();
+    odroid_spibus_reset();
+
+    DisplayFooter("");
+
+    flash_job_t job = {0};
+
+    if (update)
+    {
+        odroid_app_t* installed = &apps[updateIndex];
+
+        job.update = true;
+        job.keepParts = firmware_kept_parts(installed, fw);
+        job.sector = malloc(ERASE_BLOCK_SIZE);
+        if (!job.sector) abort();
+
+        currentFlashAddress = installed->startOffset;
+
+        // The old entry goes first, so an update that doesn't complete leaves
+        // the region free like a failed install. Rewriting the table clears
+        // the staged entry, stage it again.
+        memmove(installed, installed + 1, (apps_count - updateIndex - 1) * sizeof(odroid_app_t));
+        apps_count--;
+        write_app_table();
+
+        app = &apps[apps_count];
+        firmware_stage_app(app, fw, fullPath);
+    }
+
+    // Single pass: the checksum covers everything but its own trailing four
+    // bytes and is computed on the data as it goes to flash. Nothing below
+    // touches the app table, so an install that fails the check leaves its
+    // region free again.
+    ESP_LOGI(__func__, "Expected checksum: %#010x",fw->checksum);
+
+    odroid_sdcard_stream_t* stream = odroid_sdcard_stream_open(fullPath, 0, fw->fileSize - sizeof(fw->checksum),
+        FLASH_STREAM_BUFFERS, FLASH_STREAM_BUFFER_SIZE);
+    if (!stream)
+    {
+        DisplayError("FILE OPEN ERROR");
+        indicate_error();
+    }
+
+    app->magic = APP_MAGIC;
+    app->startOffset = currentFlashAddress;
+
+    job.stream = stream;
+    job.app = app;
+    job.dataOffset = fw->dataOffset;
+    job.flashAddress = currentFlashAddress;
+
+    job.progress = xQueueCreate(1, sizeof(flash_progress_t));
+    if (!job.progress) abort();
+
+    xTaskCreatePinnedToCore(&flash_write_task, "flash_write", FLASH_WRITER_STACK_SIZE, &job, uxTaskPriorityGet(NULL), NULL, 0);
+
+    // Follow the writer until it is done
+    flash_progress_t progress = {.part = -1};
+    int shownPart = -1;
+    bool shownErasing = false;
+
+    while (!progress.done)
+    {
+        xQueueReceive(job.progress, &progress, portMAX_DELAY);
+
+        if (progress.part != shownPart || progress.erasing != shownErasing)
+        {
+            shownPart = progress.part;
+            shownErasing = progress.erasing;
+
+            sprintf(tempstring, "%s (%d/%d)", progress.erasing ? "Erasing ..." : (update ? "Updating" : "Writing"),
+                progress.part + 1, app->parts_count);
+            DisplayProgress(progress.percent);
+            DisplayMessage(tempstring);
+        }
+        else if (!progress.done)
+        {
+            DisplayProgressUpdate(progress.percent);
+        }
+    }
+
+    while (!job.exited) vTaskDelay(1);
+    vQueueDelete(job.progress);
+
+    currentFlashAddress = job.flashAddress;
+    uint32_t checksum = job.checksum;
+
+    if (update)
+    {
+        ESP_LOGI(__func__, "Updated in place: %d sectors written, %d unchanged", job.sectorsWritten, job.sectorsKept);
+        free(job.sector);
+    }
+
+    odroid_sdcard_stream_close(stream);
+
+    odroid_spibus_dump();
+
+    ESP_LOGI(__func__, "Computed checksum: %#010x", checksum);
+
+    if (progress.error)
+    {
+        DisplayError((char*)progress.error);
+        indicate_error();
+    }
+
+    if (checksum != fw->checksum)
+    {
+        odroid_power_performance_end();
+
+        DisplayError("CHECKSUM MISMATCH ERROR");
+        DisplayFooter("[B] Go Back");
+
+        input_flush_events();
+        while (wait_for_button_press(-1) != ODROID_INPUT_B);
+        return;
+    }
+
+    // 64K align our endOffset
+    app->endOffset = ALIGN_ADDRESS(currentFlashAddress, 0x10000) - 1;
+
+    // Remember the install order, for display sorting
+    app->installSeq = nextInstallSeq++;
+
+    // Write app table
+    apps_count++; // Everything went well, acknowledge the new app
+    write_app_table();
+
+    odroid_power_performance_end();
+
+    DisplayMessage("Ready !");
+    DisplayFooter("[B] Go Back   |   [A] Boot");
+
+    input_flush_events();
+
+    while (1) {
+        int btn = wait_for_button_press(-1);
+
+        if (btn == ODROID_INPUT_A) break;
+        if (btn == ODROID_INPUT_B) return;
+    }
+
+    // Write partition table
+    write_partition_table(app->parts, app->parts_count, app->startOffset);
 
-    sprintf(tempstring, "Free space: %.2fMB (%d block)", (double)totalFreeSpace / 1024 / 1024, count);
+    // boot firmware
+    boot_application();
+}
+
+
+static void ui_draw_title(char* TITLE, char* FOOTER)
+{
+    UG_FillFrame(0, 0, 319, 239, C_WHITE);
+
+    // Header
+    UG_FillFrame(0, 0, 319, 15, C_MIDNIGHT_BLUE);
+    UG_FontSelect(&FONT_8X8);
+    const short titleLeft = (320 / 2) - (strlen(TITLE) * 9 / 2);
+    UG_SetForecolor(C_WHITE);
+    UG_SetBackcolor(C_MIDNIGHT_BLUE);
+    UG_PutString(titleLeft, 4, TITLE);
+
+    // Footer
+    UG_FontSelect(&FONT_8X8);
+    UG_SetBackcolor(C_MIDNIGHT_BLUE);
+    UG_SetForecolor(C_LIGHT_GRAY);
+    UG_FillFrame(0, 239 - 16, 319, 239, C_MIDNIGHT_BLUE);
+    const short footerLeft = (320 / 2) - (strlen(FOOTER) * 9 / 2);
+    UG_PutString(footerLeft, 240 - 4 - 8, FOOTER);
+}
+
+
+static void ui_draw_battery()
+{
+    UG_FontSelect(&FONT_8X8);
+    UG_SetForecolor(0x8C51);
+
+    sprintf(tempstring, "%d%%", batteryPercent);
+    UG_PutString(320 - (9 * strlen(tempstring)) - 4, 4, tempstring);
+}
+
+static void ui_draw_indicators(int page, int totalPages, bool final)
+{
+    UG_FontSelect(&FONT_8X8);
+    UG_SetForecolor(0x8C51);
+
+    // Page indicator, '?' while the count can still change
+    sprintf(tempstring, final ? "%d/%d" : "%d/%d?", page, totalPages);
+    UG_PutString(4, 4, tempstring);
+
+    ui_draw_battery();
+}
+
+// Only the header band is sent, the rest of the screen is left as is
+static void ui_update_battery()
+{
+    UG_FillFrame(320 - (9 * 4) - 4, 0, 319, 15, C_MIDNIGHT_BLUE);
+    UG_SetBackcolor(C_MIDNIGHT_BLUE);
+    ui_draw_battery();
+
+    ili9341_write_frame_rectangleLE(0, 0, 320, 16, fb);
+}
+
+// Index the firmware folder in the background once the card is up
+static void catalog_start()
+{
+    if (catalog.path) return;
+
+    odroid_fwindex_open(&catalog, FIRMWARE_PATH, sizeof(odroid_fw_t), &firmware_get_index_entry, JOB_FWINDEX);
+}
+
+// The card is mounted on first use, or by the background mount started with
+// the first frame. Only code that actually needs the card reports it missing.
+static bool sdcard_require()
+{
+    if (odroid_sdcard_open(SD_CARD, nvs_h) != ESP_OK) return false;
+
+    catalog_start();
+    return true;
+}
+
+// Blocks until a button is pressed or a job reports back. Events that only
+// touch the header are handled here. Returns the button or -1 for a job event.
+static int ui_wait_for_event(odroid_event_t* event)
+{
+    while (input_wait_event(event, -1))
+    {
+        if (event->type == ODROID_EVENT_INPUT && event->input.pressed)
+        {
+            return event->input.button;
+        }
+        else if (event->type == ODROID_EVENT_JOB)
+        {
+            if (event->id == JOB_SDCARD && event->value == ESP_OK) catalog_start();
+            return -1;
+        }
+        else if (event->type == ODROID_EVENT_BATTERY)
+        {
+            ui_update_battery();
+        }
+    }
+
+    return -1;
+}
+
+// Blocks until a button is pressed
+static int ui_wait_for_press()
+{
+    odroid_event_t event;
+    int btn;
+
+    while ((btn = ui_wait_for_event(&event)) < 0);
+
+    return btn;
+}
+
+
+// START + UP/DOWN moves between initials instead of single items
+static bool ui_jump_modifier(int btn)
+{
+    return (btn == ODROID_INPUT_UP || btn == ODROID_INPUT_DOWN) &&
+        (input_read_mask() & ODROID_INPUT_BIT(ODROID_INPUT_START));
+}
+
+
+static void ui_get_tile_position(int line, short* left, short* top)
+{
+    const int innerHeight = 240 - (16 * 2); // 208
+    const int itemHeight = innerHeight / ITEM_COUNT; // 52
+
+    const int rightWidth = (213); // 320 * (2.0 / 3.0)
+    const int leftWidth = 320 - rightWidth;
+
+    // Tile width = 86, height = 48 (16:9)
+    *left = (leftWidth / 2) - (86 / 2);
+    *top = 16 + (line * itemHeight) - 1 + 2;
+}
+
+
+static void ui_draw_row(int line, char *line1, char* line2, uint16_t color, uint16_t *tile, bool selected)
+{
+    const int innerHeight = 240 - (16 * 2); // 208
+    const int itemHeight = innerHeight / ITEM_COUNT; // 52
+
+    const int rightWidth = (213); // 320 * (2.0 / 3.0)
+    const short textLeft = 320 - rightWidth;
+
+    short top = 16 + (line * itemHeight) - 1;
+    short imageLeft, imageTop;
+    ui_get_tile_position(line, &imageLeft, &imageTop);
+
+    UG_FontSelect(&FONT_8X12);
+
+    UG_SetBackcolor(selected ? C_YELLOW : C_WHITE);
+    UG_FillFrame(0, top + 2, 319, top + itemHeight - 1 - 1, UG_GetBackcolor());
 
-    ui_draw_title("Select a file", tempstring);
-    ui_draw_indicators(page / ITEM_COUNT + 1, (int)ceil((double)fileCount / ITEM_COUNT));
+    ui_draw_image(imageLeft, imageTop, TILE_WIDTH, TILE_HEIGHT, tile);
+
+    UG_SetForecolor(C_BLACK);
+    UG_PutString(textLeft, top + 2 + 2 + 7, line1);
+
+    UG_SetForecolor(color);
+    UG_PutString(textLeft, top + 2 + 2 + 23, line2);
+}
+
+
+// Returns true if some of the rows are placeholders for files not indexed yet
+static bool ui_draw_page(odroid_fwindex_t* index, int currentItem, char* footer)
+{
+    int fileCount = index->count;
+    int page = (currentItem / ITEM_COUNT) * ITEM_COUNT;
+    bool pending = false;
+
+    ui_draw_title("Select a file", footer);
+    ui_draw_indicators(page / ITEM_COUNT + 1, (int)ceil((double)fileCount / ITEM_COUNT), index->final);
 
 	if (fileCount < 1)
 	{
-        DisplayMessage("SD Card Empty");
-        return;
+        DisplayMessage(index->final ? "SD Card Empty" : "Reading firmware folder ...");
+        return !index->final;
 	}
 
     char line1[64], line2[64];
     uint16_t color = C_GRAY;
 
+    // Metadata is in memory, headers come from the cache or the catalog.
+    // Moving within a page that was drawn recently doesn't touch the card.
     for (int line = 0; line < ITEM_COUNT && (page + line) < fileCount; ++line)
     {
-        char* fileName = files[page + line];
-        if (!fileName) abort();
+        char* fileName = index->names[page + line];
+        odroid_fwindex_entry_t* entry = &index->entries[page + line];
 
-        sprintf(tempstring, "%s/%s", FIRMWARE_PATH, fileName);
-        bool valid = firmware_get_info(tempstring, fwInfoBuffer);
+        const odroid_fw_t* fw = firmware_get_catalog_info(index, page + line);
+        uint16_t* tile = fw ? (uint16_t*)fw->fileHeader.tile : NULL;
 
         strcpy(line1, fileName);
         line1[strlen(fileName) - 3] = 0; // ".fw" = 3
 
-        if (valid) {
+        if (entry->pending) {
+            color = C_GRAY;
+            sprintf(line2, "Reading ...");
+            pending = true;
+        } else if (fw) {
             color = C_GRAY;
-            sprintf(line2, "%.2f MB", (float)fwInfoBuffer->flashSize / 1024 / 1024);
+            sprintf(line2, "%.2f MB", (float)entry->flashSize / 1024 / 1024);
         } else {
             color = C_RED;
             sprintf(line2, "Invalid firmware");
         }
 
-        ui_draw_row(line, line1, line2, color,
-                        fwInfoBuffer->fileHeader.tile, (page + line) == currentItem);
+        if (!tile)
+        {
+            // Blank placeholder tile
+            tile = fwInfoBuffer->fileHeader.tile;
+            memset(tile, 0xff, FIRMWARE_TILE_SIZE * sizeof(uint16_t));
+        }
+
+        ui_draw_row(line, line1, line2, color, tile, (page + line) == currentItem);
     }
 
     UpdateDisplay();
+
+    return pending;
+}
+
+static bool ui_coverart_cancel()
+{
+    return input_press_pending();
+}
+
+
+// Draws the optional sidecar cover art (<name>.jpg) over the tile of the selected row.
+// Decoding stops as soon as a press is queued, the press itself stays queued.
+// covers lists the .jpg files of the folder, only those are opened.
+static void ui_draw_coverart(const char* path, const char* fileName, int line, char** covers, int coverCount)
+{
+    size_t nameLength = strlen(fileName) - 3; // ".fw" = 3
+    bool found = false;
+
+    for (int i = 0; i < coverCount && !found; ++i)
+    {
+        found = strlen(covers[i]) == nameLength + 4 && strncasecmp(covers[i], fileName, nameLength) == 0;
+    }
+
+    if (!found) return;
+
+    short left, top;
+    ui_get_tile_position(line, &left, &top);
+
+    sprintf(tempstring, "%s/%s", path, fileName);
+    strcpy(tempstring + strlen(tempstring) - 3, ".jpg"); // ".fw" = 3
+
+    odroid_jpeg_draw_file(tempstring, left, top, TILE_WIDTH, TILE_HEIGHT, &ui_coverart_cancel);
+}
+
+
+// Loads the pages around the current one into the cache while the user looks
+// at it. Stops as soon as a press is queued.
+static void ui_prefetch_pages(odroid_fwindex_t* index, int currentItem)
+{
+    // Without the cache (no PSRAM) each read would only overwrite fwInfoBuffer
+    if (!fwCache) return;
+
+    int page = (currentItem / ITEM_COUNT) * ITEM_COUNT;
+    const int pages[] = {page + ITEM_COUNT, page - ITEM_COUNT};
+
+    for (int p = 0; p < 2; ++p)
+    {
+        for (int item = pages[p]; item < pages[p] + ITEM_COUNT; ++item)
+        {
+            if (input_press_pending()) return;
+            if (item < 0 || item >= index->count) break;
+
+            firmware_get_catalog_info(index, item);
+        }
+    }
+}
+
+static const char* file_initials_name(void* arg, int index)
+{
+    return ((char**)arg)[index];
 }
 
 char* ui_choose_file(const char* path)
@@ -1205,7 +1823,7 @@ char* ui_choose_file(const char* path)
     ESP_LOGD(__func__, "HEAP=%#010x", esp_get_free_heap_size());
 
     // Check SD card
-    if (sdcardret != ESP_OK)
+    if (!sdcard_require())
     {
         ui_draw_title("Error", "Error");
         DisplayError("SD CARD ERROR");
@@ -1215,25 +1833,123 @@ char* ui_choose_file(const char* path)
 
     char* result = NULL;
 
-    char** files = NULL;
-    int fileCount = odroid_sdcard_files_get(path, ".fw", &files);
-    ESP_LOGI(__func__, "fileCount=%d", fileCount);
+    // The catalog is indexed in the background since the card came up,
+    // whatever it has published so far is shown and the rest comes in as events
+    odroid_fwindex_t* index = &catalog;
+    odroid_fwindex_update(index);
+
+    char** files = index->names;
+    int fileCount = index->count;
+    ESP_LOGI(__func__, "fileCount=%d%s", fileCount, index->final ? "" : " (indexing)");
+
+    // One directory read up front, moving the cursor then only opens the
+    // cover art that is actually there
+    char** covers = NULL;
+    int coverCount = odroid_sdcard_files_get(path, ".jpg", &covers);
+
+    odroid_initials_t initials = {0};
+    odroid_initials_build(&initials, fileCount, &file_initials_name, files);
+
+    // Free space does not change while browsing
+    odroid_flash_block_t *blocks;
+    size_t count, totalFreeSpace;
+
+    find_free_blocks(&blocks, &count, &totalFreeSpace);
+    free(blocks);
+
+    char footer[64];
+    sprintf(footer, "Free space: %.2fMB (%d block)", (double)totalFreeSpace / 1024 / 1024, count);
 
     // Selection
     int currentItem = 0;
+    bool redraw = true;
+    bool pagePending = false;
+    char jumpKey = 0;
 
     while (true)
     {
-        ui_draw_page(files, fileCount, currentItem);
-
         int page = (currentItem / ITEM_COUNT) * ITEM_COUNT;
 
-        // Wait for input but refresh display after 1000 ticks if no input
-        int btn = wait_for_button_press(1000);
+        // Skip the frame if another press is already waiting, it would be stale.
+        // Jumps only move the cursor, the destination page is the only one read.
+        if (redraw && !input_press_pending())
+        {
+            char jumpFooter[32];
+            sprintf(jumpFooter, "Jump to %c", jumpKey);
+
+            pagePending = ui_draw_page(index, currentItem, jumpKey ? jumpFooter : footer);
+
+            if (fileCount > 0)
+            {
+                ui_draw_coverart(path, files[currentItem], currentItem - page, covers, coverCount);
+            }
+
+            redraw = false;
+
+            ui_prefetch_pages(index, currentItem);
+        }
+
+        odroid_event_t event;
+        int btn = ui_wait_for_event(&event);
+
+        if (btn < 0)
+        {
+            if (event.id != JOB_FWINDEX) continue;
+
+            if (event.value >= 0)
+            {
+                // Indexing progress, only shown while there is nothing to browse yet
+                if (fileCount < 1)
+                {
+                    sprintf(tempstring, "Reading firmware folder ... %d", event.value);
+                    DisplayMessage(tempstring);
+                }
+
+                // Placeholders on this page may have been filled in
+                if (pagePending) redraw = true;
+                continue;
+            }
+
+            // Keep the cursor on the same file if it is still there. The name
+            // is copied first, the update frees the listing it points into.
+            char* selected = (fileCount > 0) ? strdup(files[currentItem]) : NULL;
+
+            if (odroid_fwindex_update(index))
+            {
+                files = index->names;
+                fileCount = index->count;
+                currentItem = 0;
+
+                if (selected)
+                {
+                    int item = odroid_fwindex_find(index, selected);
+                    if (item >= 0) currentItem = item;
+                }
+
+                odroid_initials_build(&initials, fileCount, &file_initials_name, files);
+
+                ESP_LOGI(__func__, "fileCount=%d", fileCount);
+            }
+
+            free(selected);
+
+            // Listing or page indicator changed
+            redraw = true;
+            continue;
+        }
+
+        int previousItem = currentItem;
+        char previousKey = jumpKey;
+        jumpKey = 0;
 
         if (fileCount > 0)
         {
-            if (btn == ODROID_INPUT_DOWN)
+            if (ui_jump_modifier(btn))
+            {
+                currentItem = odroid_initials_jump(&initials, currentItem,
+                    (btn == ODROID_INPUT_DOWN) ? 1 : -1, &jumpKey);
+            }
+            else if (btn == ODROID_INPUT_DOWN)
             {
                 if (++currentItem >= fileCount) currentItem = 0;
             }
@@ -1271,9 +1987,12 @@ char* ui_choose_file(const char* path)
         {
             break;
         }
+
+        if (currentItem != previousItem || jumpKey != previousKey) redraw = true;
     }
 
-    odroid_sdcard_files_free(files, fileCount);
+    odroid_initials_free(&initials);
+    odroid_sdcard_files_free(covers, coverCount);
 
     return result;
 }
@@ -1359,12 +2078,294 @@ static int ui_choose_dialog(dialog_option_t *options, int optionCount, bool canc
 }
 
 
-static void ui_draw_app_page(int currentItem)
+// Monospace text straight to the LCD, one 8 pixel high band per line.
+// Much cheaper than UG_PutString + a full frame update for screens that are mostly text.
+static void ui_draw_text_line(short top, const char* text, uint16_t color, uint16_t background)
+{
+    static uint16_t band[320 * 8];
+    const UG_FONT* font = &FONT_8X8;
+
+    for (int col = 0; col < LOG_VIEW_COLUMNS; ++col)
+    {
+        uint8_t chr = *text ? (uint8_t)*text++ : ' ';
+        if (chr < font->start_char || chr > font->end_char) chr = ' ';
+
+        const uint8_t* glyph = font->p + (chr - font->start_char) * font->char_height;
+
+        for (int y = 0; y < 8; ++y)
+        {
+            uint8_t bits = glyph[y];
+            uint16_t* dst = band + (y * 320) + (col * 8);
+
+            for (int x = 0; x < 8; ++x, bits >>= 1)
+            {
+                dst[x] = (bits & 0x01) ? color : background;
+            }
+        }
+    }
+
+    ili9341_write_frame_rectangleLE(0, top, 320, 8, band);
+}
+
+
+static void ui_log_viewer()
+{
+    char line[256];
+
+    int scroll = 0; // lines above the newest entry
+    int column = 0;
+    uint32_t drawnHead = 0;
+    int drawnScroll = -1, drawnColumn = -1;
+
+    ui_draw_title("System log", "[B] Back  [A] Dump to UART");
+    UpdateDisplay();
+
+    while (true)
+    {
+        uint32_t head = odroid_log_head();
+        uint32_t tail = odroid_log_tail();
+        int maxScroll = (int)(head - tail) - LOG_VIEW_LINES;
+        if (maxScroll < 0) maxScroll = 0;
+        if (scroll > maxScroll) scroll = maxScroll;
+
+        // Only redraw when the view actually moved. New entries only matter when following the tail.
+        if (scroll != drawnScroll || column != drawnColumn || (scroll == 0 && head != drawnHead))
+        {
+            uint32_t first = head - scroll - LOG_VIEW_LINES;
+            if ((int)(head - tail) < LOG_VIEW_LINES) first = tail;
+
+            for (int i = 0; i < LOG_VIEW_LINES; ++i)
+            {
+                uint32_t seq = first + i;
+                uint16_t color = C_WHITE;
+
+                if (seq >= head || !odroid_log_format(seq, line, sizeof(line)))
+                {
+                    line[0] = 0;
+                }
+
+                if (line[0] == 'E') color = C_RED;
+                else if (line[0] == 'W') color = C_YELLOW;
+                else if (line[0] == 'D' || line[0] == 'V') color = C_GRAY;
+
+                const char* text = (strlen(line) > column) ? line + column : "";
+                if (i == LOG_VIEW_LINES - 1) ili9341_set_frame_timestamp(odroid_latency_take());
+                ui_draw_text_line(LOG_VIEW_TOP + i * 8, text, color, C_BLACK);
+            }
+
+            drawnHead = head;
+            drawnScroll = scroll;
+            drawnColumn = column;
+        }
+
+        int btn = wait_for_button_press(scroll == 0 ? 25 : -1);
+
+        if (btn == ODROID_INPUT_UP)
+        {
+            if (++scroll > maxScroll) scroll = maxScroll;
+        }
+        else if (btn == ODROID_INPUT_DOWN)
+        {
+            if (--scroll < 0) scroll = 0;
+        }
+        else if (btn == ODROID_INPUT_RIGHT)
+        {
+            if ((column += LOG_VIEW_COLUMNS / 2) > sizeof(line) - LOG_VIEW_COLUMNS) column = sizeof(line) - LOG_VIEW_COLUMNS;
+        }
+        else if (btn == ODROID_INPUT_LEFT)
+        {
+            if ((column -= LOG_VIEW_COLUMNS / 2) < 0) column = 0;
+        }
+        else if (btn == ODROID_INPUT_A)
+        {
+            printf("\n#################### log dump (%u entries) ####################\n", head - tail);
+            for (uint32_t seq = tail; seq < head; ++seq)
+            {
+                if (odroid_log_format(seq, line, sizeof(line))) printf("%s\n", line);
+            }
+        }
+        else if (btn == ODROID_INPUT_B)
+        {
+            break;
+        }
+    }
+}
+
+
+static void ui_latency_viewer()
+{
+    char line[LOG_VIEW_COLUMNS + 1];
+    odroid_latency_stats_t stats;
+    uint32_t drawnCount = UINT32_MAX;
+
+    ui_draw_title("Input latency", "[B] Back [A] Dump [SELECT] Reset");
+    UpdateDisplay();
+
+    while (true)
+    {
+        odroid_latency_get(&stats);
+
+        if (stats.count != drawnCount)
+        {
+            const char* labels[] = {"p50", "p95", "max"};
+            uint32_t values[] = {stats.p50_us, stats.p95_us, stats.max_us};
+
+            snprintf(line, sizeof(line), " Press to photon, %u samples", stats.count);
+            ui_draw_text_line(LOG_VIEW_TOP + 8, line, C_WHITE, C_BLACK);
+
+            for (int i = 0; i < 3; ++i)
+            {
+                snprintf(line, sizeof(line), "   %s %5u.%u ms", labels[i], values[i] / 1000, (values[i] % 1000) / 100);
+                if (i == 2) ili9341_set_frame_timestamp(odroid_latency_take());
+                ui_draw_text_line(LOG_VIEW_TOP + 24 + i * 12, line, C_WHITE, C_BLACK);
+            }
+
+            drawnCount = stats.count;
+        }
+
+        int btn = wait_for_button_press(250);
+
+        if (btn == ODROID_INPUT_A)
+        {
+            odroid_latency_dump();
+            odroid_spibus_dump();
+        }
+        else if (btn == ODROID_INPUT_SELECT)
+        {
+            odroid_latency_reset();
+            odroid_spibus_reset();
+            drawnCount = UINT32_MAX;
+        }
+        else if (btn == ODROID_INPUT_B)
+        {
+            break;
+        }
+    }
+}
+
+
+static void ui_input_record_toggle()
+{
+    if (!input_recording())
+    {
+        if (!sdcard_require())
+        {
+            DisplayNotification("SD CARD ERROR");
+            return;
+        }
+
+        if (input_record_start(INPUT_RECORD_CAPACITY))
+            DisplayNotification("Recording input ...");
+        else
+            DisplayNotification("Unable to start recording!");
+        return;
+    }
+
+    odroid_input_event_t* events;
+    int count = input_record_stop(&events);
+    if (count < 0) return;
+
+    // Drop the presses that opened the menu to stop the recording
+    for (int i = count - 1; i >= 0; --i)
+    {
+        if (events[i].button == ODROID_INPUT_MENU && events[i].pressed && !events[i].repeat)
+        {
+            count = i;
+            break;
+        }
+    }
+
+    if (odroid_input_script_save(INPUT_SCRIPT_PATH, events, count) < 0)
+    {
+        ESP_LOGE(__func__, "saving %s failed.", INPUT_SCRIPT_PATH);
+        DisplayNotification("Unable to save the recording!");
+    }
+    else
+    {
+        sprintf(tempstring, "Saved %d input events", count);
+        DisplayNotification(tempstring);
+    }
+
+    free(events);
+}
+
+static void ui_input_replay_toggle()
+{
+    if (input_replaying())
+    {
+        input_replay_stop();
+        DisplayNotification("Replay stopped");
+        return;
+    }
+
+    if (!sdcard_require())
+    {
+        DisplayNotification("SD CARD ERROR");
+        return;
+    }
+
+    odroid_input_event_t* events;
+    int count = odroid_input_script_load(INPUT_SCRIPT_PATH, &events);
+    if (count < 1)
+    {
+        if (count == 0) free(events);
+        DisplayNotification("No input script found!");
+        return;
+    }
+
+    sprintf(tempstring, "Replaying %d input events", count);
+    DisplayNotification(tempstring);
+    vTaskDelay(1000 / portTICK_PERIOD_MS);
+
+    // Start from a clean histogram so runs can be compared
+    odroid_latency_reset();
+    input_flush_events();
+    input_replay_start(events, count);
+}
+
+static void ui_diagnostics_menu()
+{
+    bool recording = input_recording();
+    bool replaying = input_replaying();
+
+    dialog_option_t options[] = {
+        {0, "View system log", true},
+        {1, "Input latency", true},
+        {2, "Record input", !replaying},
+        {3, "Replay input script", !recording},
+    };
+
+    if (recording) strcpy(options[2].label, "Stop input recording");
+    if (replaying) strcpy(options[3].label, "Stop input replay");
+
+    switch (ui_choose_dialog(options, 4, true))
+    {
+        case 0:
+            ui_log_viewer();
+            break;
+        case 1:
+            ui_latency_viewer();
+            break;
+        case 2:
+            ui_input_record_toggle();
+            break;
+        case 3:
+            ui_input_replay_toggle();
+            break;
+    }
+}
+
+
+static void ui_draw_app_page(int currentItem, char jumpKey)
 {
     int page = (currentItem / ITEM_COUNT) * ITEM_COUNT;
 
-    ui_draw_title("ODROID-GO", "[MENU] Menu   |   [A] Boot App");
-    ui_draw_indicators(page / ITEM_COUNT + 1, (int)ceil((double)apps_count / ITEM_COUNT));
+    char footer[32];
+    if (jumpKey) sprintf(footer, "Jump to %c", jumpKey);
+    else strcpy(footer, "[MENU] Menu   |   [A] Boot App");
+
+    ui_draw_title("ODROID-GO", footer);
+    ui_draw_indicators(page / ITEM_COUNT + 1, (int)ceil((double)apps_count / ITEM_COUNT), true);
 
 	if (apps_count < 1)
 	{
@@ -1394,20 +2395,39 @@ void ui_choose_app()
 
     int currentItem = 0;
     int queuedBtn = -1;
+    bool redraw = true;
+    char jumpKey = 0;
 
     while (true)
     {
-        ui_draw_app_page(currentItem);
+        if (redraw && (queuedBtn != -1 || !input_press_pending()))
+        {
+            ui_draw_app_page(currentItem, jumpKey);
+            redraw = false;
+        }
+
+        // Bring the card up in the background once the first page is out
+        if (odroid_sdcard_get_state() == ODROID_SDCARD_UNMOUNTED)
+        {
+            odroid_sdcard_open_async(SD_CARD, nvs_h, JOB_SDCARD);
+        }
 
         int page = (currentItem / ITEM_COUNT) * ITEM_COUNT;
 
-        // Wait for input but refresh display after 1000 ticks if no input
-        int btn = (queuedBtn != -1) ? queuedBtn : wait_for_button_press(1000);
+        int btn = (queuedBtn != -1) ? queuedBtn : ui_wait_for_press();
+        int previousItem = currentItem;
+        char previousKey = jumpKey;
         queuedBtn = -1;
+        jumpKey = 0;
 
 		if (apps_count > 0)
 		{
-            if (btn == ODROID_INPUT_DOWN)
+            if (ui_jump_modifier(btn))
+            {
+                currentItem = odroid_initials_jump(&appInitials, currentItem,
+                    (btn == ODROID_INPUT_DOWN) ? 1 : -1, &jumpKey);
+            }
+            else if (btn == ODROID_INPUT_DOWN)
 	        {
                 if (++currentItem >= apps_count) currentItem = 0;
 	        }
@@ -1443,7 +2463,7 @@ void ui_choose_app()
                         displayOrder = (displayOrder & 1);
 
                     sort_app_table(displayOrder);
-                    ui_draw_app_page(currentItem);
+                    ui_draw_app_page(currentItem, 0);
 
                     char descriptions[][16] = {"OFFSET", "INSTALL", "NAME"};
                     char order[][5] = {"ASC", "DESC"};
@@ -1456,6 +2476,7 @@ void ui_choose_app()
 
                 nvs_set_i32(nvs_h, "display_order", displayOrder);
                 nvs_commit(nvs_h);
+                redraw = true;
             }
         }
 
@@ -1466,10 +2487,11 @@ void ui_choose_app()
                 {1, "Erase selected app", apps_count > 0},
                 {2, "Erase selected NVS", apps_count > 0},
                 {3, "Erase all apps", apps_count > 0},
+                {5, "Diagnostics", true},
                 {4, "Restart System", true}
             };
 
-            int choice = ui_choose_dialog(options, 5, true);
+            int choice = ui_choose_dialog(options, 6, true);
             char* fileName;
 
             switch(choice) {
@@ -1506,9 +2528,13 @@ void ui_choose_app()
                 case 4: // Restart
                     cleanup_and_restart();
                     break;
+                case 5: // Log, latency, input recorder
+                    ui_diagnostics_menu();
+                    break;
             }
 
             sort_app_table(displayOrder);
+            redraw = true;
         }
         else if (btn == ODROID_INPUT_B)
         {
@@ -1519,7 +2545,10 @@ void ui_choose_app()
                     ESP_PARTITION_SUBTYPE_APP_OTA_0, NULL)); // Restore OTA data if possible and reboot
                 cleanup_and_restart();
             }
+            redraw = true;
         }
+
+        if (currentItem != previousItem || jumpKey != previousKey) redraw = true;
     }
 }
 
@@ -1528,6 +2557,15 @@ void app_main(void)
 {
     printf("\n\n#################### odroid-go-firmware (Ver: "PROJECT_VER") ####################\n\n");
 
+    // Capture log output for the on-device viewer
+    odroid_log_init();
+
+    // Frequency scaling and light sleep, before anything takes a lock
+    odroid_power_init();
+
+    // LCD and SD card share HSPI
+    odroid_spibus_init();
+
     // Init NVS
     nvs_flash_init_partition(NVS_PART_NAME);
     if (nvs_open_from_partition(NVS_PART_NAME, "settings", NVS_READWRITE, &nvs_h) != ESP_OK) {
@@ -1542,8 +2580,8 @@ void app_main(void)
     gpio_set_direction(GPIO_NUM_2, GPIO_MODE_OUTPUT);
     gpio_set_level(GPIO_NUM_2, 1);
 
-    // Has to be before LCD
-    sdcardret = odroid_sdcard_open(SD_CARD);
+    // Claims the shared SPI bus, has to be before LCD. The card is mounted later.
+    odroid_sdcard_init();
 
     ili9341_init();
     ili9341_clear(0xffff);
@@ -1551,7 +2589,7 @@ void app_main(void)
     UG_Init(&gui, pset, 320, 240);
 
     // Start battery monitor
-    xTaskCreate(&battery_task, "battery_task", 4096, NULL, 5, NULL);
+    odroid_battery_init(&battery_changed);
 
     fwInfoBuffer = malloc(sizeof(odroid_fw_t));
     dataBuffer = malloc(FLASH_BLOCK_SIZE);
@@ -1563,6 +2601,8 @@ void app_main(void)
         indicate_error();
     }
 
+    fwCache = odroid_cache_create(FW_CACHE_CAPACITY, sizeof(odroid_fw_t));
+
     read_partition_table();
     read_app_table();
 
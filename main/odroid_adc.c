@@ -0,0 +1,191 @@
+#include "odroid_adc.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+
+#include <stdlib.h>
+
+
+#define ADC_CHANNEL_MAX (4)
+#define ADC_TICK_MS (10)
+
+// Every ADC1 conversion goes through this task, channels are converted in the
+// order they were added. The width is set once and attenuation is per channel
+// in hardware, so nothing is reconfigured between conversions. Between passes
+// the task sleeps until the next channel is due, so idle periods stay long
+// enough for automatic light sleep.
+typedef struct
+{
+    adc1_channel_t channel;
+    uint16_t period_ms;
+    uint8_t filter_shift;
+    odroid_adc_callback_t callback;
+    int64_t next;
+    uint32_t accumulator; // value << filter_shift
+
+    // Published to readers, seq is odd while an update is in progress
+    volatile uint32_t seq;
+    volatile uint16_t value;
+    volatile int64_t timestamp;
+} adc_channel_t;
+
+static adc_channel_t channels[ADC_CHANNEL_MAX];
+static volatile int channel_count = 0;
+static bool adc_started = false;
+static TaskHandle_t adc_task_handle;
+static portMUX_TYPE adc_lock = portMUX_INITIALIZER_UNLOCKED; // serializes registration only
+
+
+static void adc_publish(adc_channel_t* ch, uint16_t value, int64_t timestamp)
+{
+    ch->seq++;
+    __asm__("memw");
+    ch->value = value;
+    ch->timestamp = timestamp;
+    __asm__("memw");
+    ch->seq++;
+}
+
+static void adc_task(void *arg)
+{
+    while (1)
+    {
+        const int count = channel_count;
+        int64_t wake = INT64_MAX;
+
+        for (int i = 0; i < count; ++i)
+        {
+            adc_channel_t* ch = &channels[i];
+            int64_t now = esp_timer_get_time();
+
+            if (now < ch->next)
+            {
+                if (ch->next < wake) wake = ch->next;
+                continue;
+            }
+
+            int raw = adc1_get_raw(ch->channel);
+            now = esp_timer_get_time();
+
+            // Exponential moving average, seeded with the first sample
+            if (ch->seq == 0) ch->accumulator = raw << ch->filter_shift;
+            else ch->accumulator += raw - (ch->accumulator >> ch->filter_shift);
+
+            uint16_t value = ch->accumulator >> ch->filter_shift;
+            adc_publish(ch, value, now);
+
+            ch->next += ch->period_ms * 1000;
+            if (ch->next < now) ch->next = now + ch->period_ms * 1000;
+
+            if (ch->callback) ch->callback(i, value, now);
+
+            if (ch->next < wake) wake = ch->next;
+        }
+
+        // Woken early when a channel is added or a period changes
+        if (wake == INT64_MAX)
+        {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+
+        int64_t delay = wake - esp_timer_get_time();
+        TickType_t ticks = (delay > 0) ? (delay + 999) / 1000 / portTICK_PERIOD_MS : 0;
+        ulTaskNotifyTake(pdTRUE, (ticks > 0) ? ticks : 1);
+    }
+}
+
+
+// Periods below 10 ms are raised to 10 ms. Callbacks run on the ADC task right
+// after the conversion and must stay short.
+int odroid_adc_add_channel(adc1_channel_t channel, adc_atten_t atten, uint16_t period_ms,
+                           uint8_t filter_shift, odroid_adc_callback_t callback)
+{
+    if (filter_shift > 15) abort();
+
+    portENTER_CRITICAL(&adc_lock);
+
+    int handle = channel_count;
+    bool start = !adc_started;
+    adc_started = true;
+
+    if (handle >= ADC_CHANNEL_MAX)
+    {
+        portEXIT_CRITICAL(&adc_lock);
+        ESP_LOGE(__func__, "too many channels.");
+        abort();
+    }
+
+    adc_channel_t* ch = &channels[handle];
+    ch->channel = channel;
+    ch->period_ms = (period_ms < ADC_TICK_MS) ? ADC_TICK_MS : period_ms;
+    ch->filter_shift = filter_shift;
+    ch->callback = callback;
+    ch->next = 0;
+    ch->seq = 0;
+
+    portEXIT_CRITICAL(&adc_lock);
+
+    if (start)
+    {
+        adc1_config_width(ADC_WIDTH_BIT_12);
+    }
+
+    adc1_config_channel_atten(channel, atten);
+
+    // Only visible to the task once fully set up
+    __asm__("memw");
+    channel_count = handle + 1;
+
+    if (start)
+    {
+        xTaskCreatePinnedToCore(&adc_task, "adc_task", 2048, NULL, 5, &adc_task_handle, 1);
+    }
+    else if (adc_task_handle)
+    {
+        xTaskNotifyGive(adc_task_handle);
+    }
+
+    ESP_LOGI(__func__, "channel %d every %d ms (handle %d).", channel, ch->period_ms, handle);
+    return handle;
+}
+
+void odroid_adc_set_period(int handle, uint16_t period_ms)
+{
+    adc_channel_t* ch = &channels[handle];
+    uint16_t period = (period_ms < ADC_TICK_MS) ? ADC_TICK_MS : period_ms;
+
+    if (ch->period_ms == period) return;
+
+    bool sooner = period < ch->period_ms;
+    ch->period_ms = period;
+
+    if (sooner)
+    {
+        ch->next = 0;
+        if (adc_task_handle) xTaskNotifyGive(adc_task_handle);
+    }
+}
+
+// Lock-free, returns 0 until the first conversion
+uint16_t odroid_adc_read(int handle, int64_t* out_timestamp)
+{
+    const adc_channel_t* ch = &channels[handle];
+    uint32_t seq;
+    uint16_t value;
+    int64_t timestamp;
+
+    do
+    {
+        seq = ch->seq;
+        __asm__("memw");
+        value = ch->value;
+        timestamp = ch->timestamp;
+        __asm__("memw");
+    } while ((seq & 1) || seq != ch->seq);
+
+    if (out_timestamp) *out_timestamp = timestamp;
+    return value;
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "driver/adc.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef void (*odroid_adc_callback_t)(int handle, uint16_t value, int64_t timestamp);
+
+int odroid_adc_add_channel(adc1_channel_t channel, adc_atten_t atten, uint16_t period_ms,
+                           uint8_t filter_shift, odroid_adc_callback_t callback);
+void odroid_adc_set_period(int handle, uint16_t period_ms);
+uint16_t odroid_adc_read(int handle, int64_t* out_timestamp);
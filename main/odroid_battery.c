@@ -0,0 +1,116 @@
+#include "odroid_battery.h"
+
+#include "odroid_adc.h"
+
+#include "esp_adc_cal.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+
+#include <stdbool.h>
+
+
+#define BATTERY_ADC_CHANNEL (ADC1_CHANNEL_0)
+#define BATTERY_FILTER_SHIFT (7) // ~128 samples
+#define BATTERY_SAMPLE_PERIOD_MS (250)
+#define BATTERY_REPORT_SAMPLES (240) // once a minute
+
+#define BATTERY_VMIN (3300)
+#define BATTERY_VMAX (4200)
+#define BATTERY_TABLE_STEP (10)
+
+// Percent * 256 every 10 mV from BATTERY_VMIN to BATTERY_VMAX, sampled from the curve
+// used by the Odroid GO Arduino library: 101 - 101 / (1 + (1.33 * (v - vmin) / (vmax - vmin)) ^ 4.5) ^ 3
+static const uint16_t battery_curve[(BATTERY_VMAX - BATTERY_VMIN) / BATTERY_TABLE_STEP + 1] = {
+        0,     0,     0,     0,     0,     1,     1,     3,     5,     9,
+       14,    22,    32,    46,    65,    88,   118,   154,   199,   254,
+      319,   397,   488,   594,   717,   859,  1020,  1203,  1409,  1640,
+     1897,  2181,  2494,  2837,  3210,  3614,  4050,  4517,  5015,  5544,
+     6101,  6687,  7299,  7935,  8593,  9269,  9960, 10664, 11377, 12094,
+    12813, 13530, 14240, 14941, 15628, 16299, 16952, 17583, 18190, 18771,
+    19326, 19852, 20349, 20818, 21257, 21667, 22049, 22402, 22729, 23030,
+    23307, 23560, 23791, 24001, 24192, 24365, 24522, 24663, 24791, 24905,
+    25008, 25100, 25183, 25256, 25322, 25381, 25434, 25480, 25522, 25559,
+    25592,
+};
+
+static volatile int battery_percent = -1;
+static volatile int battery_millivolts;
+static volatile uint32_t battery_samples;
+static volatile int64_t battery_cpu_us;
+static odroid_battery_callback_t battery_changed;
+static esp_adc_cal_characteristics_t battery_adc_cal;
+
+
+static int battery_voltage_to_percent(int millivolts)
+{
+    if (millivolts <= BATTERY_VMIN) return 0;
+    if (millivolts >= BATTERY_VMAX) return 100;
+
+    int offset = millivolts - BATTERY_VMIN;
+    int index = offset / BATTERY_TABLE_STEP;
+    int frac = offset % BATTERY_TABLE_STEP;
+
+    uint32_t value = (battery_curve[index] * (BATTERY_TABLE_STEP - frac) +
+                      battery_curve[index + 1] * frac) / BATTERY_TABLE_STEP;
+
+    return (value + 128) >> 8; // rounded
+}
+
+// Runs on the ADC service task after each conversion
+static void battery_sampled(int handle, uint16_t value, int64_t timestamp)
+{
+    static int64_t reportCpu = 0;
+    int64_t start = esp_timer_get_time();
+
+    // The battery sits behind a 1:2 divider
+    int millivolts = esp_adc_cal_raw_to_voltage(value, &battery_adc_cal) * 2;
+    int percent = battery_voltage_to_percent(millivolts);
+
+    battery_millivolts = millivolts;
+    battery_samples++;
+
+    bool changed = (percent != battery_percent);
+    battery_percent = percent;
+
+    if (changed && battery_changed)
+    {
+        battery_changed(percent);
+    }
+
+    int64_t elapsed = esp_timer_get_time() - start;
+    battery_cpu_us += elapsed;
+    reportCpu += elapsed;
+
+    if (battery_samples % BATTERY_REPORT_SAMPLES == 0)
+    {
+        ESP_LOGD(__func__, "%d%% (%d mV), %lld us CPU for the last %d samples.",
+            percent, millivolts, reportCpu, BATTERY_REPORT_SAMPLES);
+        reportCpu = 0;
+    }
+}
+
+
+void odroid_battery_init(odroid_battery_callback_t changed)
+{
+    // Some of that code is from Odroid GO Arduino library
+    esp_adc_cal_characterize(ADC_UNIT_1, ADC_ATTEN_DB_11, ADC_WIDTH_BIT_12, 1100, &battery_adc_cal);
+
+    battery_changed = changed;
+
+    // The service filters with a 1/128 moving average, seeded from the first sample
+    odroid_adc_add_channel(BATTERY_ADC_CHANNEL, ADC_ATTEN_DB_11, BATTERY_SAMPLE_PERIOD_MS,
+        BATTERY_FILTER_SHIFT, &battery_sampled);
+}
+
+int odroid_battery_percent()
+{
+    return (battery_percent < 0) ? 0 : battery_percent;
+}
+
+void odroid_battery_get_state(odroid_battery_state_t* out_state)
+{
+    out_state->percent = odroid_battery_percent();
+    out_state->millivolts = battery_millivolts;
+    out_state->samples = battery_samples;
+    out_state->cpu_us = battery_cpu_us;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+
+typedef void (*odroid_battery_callback_t)(int percent);
+
+typedef struct
+{
+    int percent;
+    int millivolts;
+    uint32_t samples;
+    int64_t cpu_us; // time spent sampling and converting since boot
+} odroid_battery_state_t;
+
+void odroid_battery_init(odroid_battery_callback_t changed);
+int odroid_battery_percent();
+void odroid_battery_get_state(odroid_battery_state_t* out_state);
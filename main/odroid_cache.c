@@ -0,0 +1,143 @@
+#include "odroid_cache.h"
+
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+// Small fixed-size LRU for file derived data. Items are keyed by path and
+// only match while the file keeps the same size and date, so a changed file
+// simply misses and its old item ages out.
+typedef struct
+{
+    char* key;
+    uint32_t hash;
+    uint32_t size;
+    uint32_t mtime;
+    uint32_t lastUse;
+    uint8_t tag;
+} cache_item_t;
+
+struct odroid_cache
+{
+    int capacity;
+    size_t itemSize;
+    uint32_t useCounter;
+    cache_item_t* items;
+    uint8_t* data;
+};
+
+
+static uint32_t cache_hash(const char* key)
+{
+    uint32_t hash = 2166136261u; // FNV-1a
+
+    while (*key)
+    {
+        hash = (hash ^ (uint8_t)*key++) * 16777619u;
+    }
+
+    return hash;
+}
+
+static int cache_find(odroid_cache_t* cache, const char* key, uint32_t hash)
+{
+    for (int i = 0; i < cache->capacity; ++i)
+    {
+        cache_item_t* item = &cache->items[i];
+
+        if (item->key && item->hash == hash && strcmp(item->key, key) == 0) return i;
+    }
+
+    return -1;
+}
+
+
+// The data lives in PSRAM. Returns NULL without PSRAM, every call below then
+// behaves as a miss and callers use their own buffer.
+odroid_cache_t* odroid_cache_create(int capacity, size_t itemSize)
+{
+    uint8_t* data = heap_caps_malloc(capacity * itemSize, MALLOC_CAP_SPIRAM);
+    if (!data)
+    {
+        ESP_LOGW(__func__, "no PSRAM for %d x %d bytes, cache disabled.", capacity, itemSize);
+        return NULL;
+    }
+
+    odroid_cache_t* cache = calloc(1, sizeof(odroid_cache_t));
+    cache_item_t* items = calloc(capacity, sizeof(cache_item_t));
+    if (!cache || !items) abort();
+
+    cache->capacity = capacity;
+    cache->itemSize = itemSize;
+    cache->items = items;
+    cache->data = data;
+
+    return cache;
+}
+
+void* odroid_cache_get(odroid_cache_t* cache, const char* key, uint32_t size, uint32_t mtime, uint8_t* out_tag)
+{
+    if (!cache) return NULL;
+
+    int i = cache_find(cache, key, cache_hash(key));
+    if (i < 0) return NULL;
+
+    cache_item_t* item = &cache->items[i];
+    if (item->size != size || item->mtime != mtime) return NULL;
+
+    item->lastUse = ++cache->useCounter;
+    if (out_tag) *out_tag = item->tag;
+
+    return cache->data + i * cache->itemSize;
+}
+
+// Returns the item to fill for key, replacing the previous one for the same
+// key or else the least recently used.
+void* odroid_cache_put(odroid_cache_t* cache, const char* key, uint32_t size, uint32_t mtime, uint8_t tag)
+{
+    if (!cache) return NULL;
+
+    uint32_t hash = cache_hash(key);
+    int i = cache_find(cache, key, hash);
+
+    if (i < 0)
+    {
+        i = 0;
+        for (int j = 1; j < cache->capacity; ++j)
+        {
+            if (cache->items[j].lastUse < cache->items[i].lastUse) i = j;
+        }
+
+        cache_item_t* item = &cache->items[i];
+        free(item->key);
+
+        item->key = strdup(key);
+        if (!item->key) abort();
+
+        item->hash = hash;
+    }
+
+    cache_item_t* item = &cache->items[i];
+    item->size = size;
+    item->mtime = mtime;
+    item->tag = tag;
+    item->lastUse = ++cache->useCounter;
+
+    return cache->data + i * cache->itemSize;
+}
+
+void odroid_cache_drop(odroid_cache_t* cache, const char* key)
+{
+    if (!cache) return;
+
+    int i = cache_find(cache, key, cache_hash(key));
+    if (i < 0) return;
+
+    cache_item_t* item = &cache->items[i];
+    free(item->key);
+
+    memset(item, 0, sizeof(*item));
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct odroid_cache odroid_cache_t;
+
+odroid_cache_t* odroid_cache_create(int capacity, size_t itemSize);
+void* odroid_cache_get(odroid_cache_t* cache, const char* key, uint32_t size, uint32_t mtime, uint8_t* out_tag);
+void* odroid_cache_put(odroid_cache_t* cache, const char* key, uint32_t size, uint32_t mtime, uint8_t tag);
+void odroid_cache_drop(odroid_cache_t* cache, const char* key);
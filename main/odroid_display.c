@@ -2,6 +2,7 @@
 #include "freertos/task.h"
 #include "esp_system.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "driver/spi_master.h"
 #include "driver/ledc.h"
 #include "driver/rtc_io.h"
@@ -9,6 +10,9 @@
 #include <string.h>
 
 #include "odroid_display.h"
+#include "odroid_latency.h"
+#include "odroid_power.h"
+#include "odroid_spibus.h"
 
 
 const gpio_num_t SPI_PIN_NUM_MISO = GPIO_NUM_19;
@@ -40,10 +44,16 @@ static spi_transaction_t trans[8];
 static spi_device_handle_t spi;
 //static volatile short freeTransactionCount = 6;
 static TaskHandle_t xTaskToNotify = NULL;
+
+// Input timestamp carried by the frame being sent, recorded once its last line is out
+static volatile int64_t frame_timestamp = 0;
+static volatile bool frame_last_line = false;
+static short frame_lines_remaining = 0;
 //static bool useCallbacks = false;
 
 
 static uint16_t line[2][320]; // Must be at least 320
+static esp_timer_handle_t backlight_timer;
 
 const int DUTY_MAX = 0x1fff;
 
@@ -151,6 +161,12 @@ static void ili_spi_pre_transfer_callback(spi_transaction_t *t)
 
 static void ili_spi_post_transfer_callback(spi_transaction_t *t)
 {
+    if(frame_last_line && frame_timestamp && t == &trans[7])
+    {
+        odroid_latency_record(frame_timestamp, esp_timer_get_time());
+        frame_timestamp = 0;
+    }
+
     if(xTaskToNotify && t == &trans[7])
     {
         BaseType_t xHigherPriorityTaskWoken = pdFALSE;
@@ -185,10 +201,19 @@ static void ili_init()
     }
 }
 
+// Frames answering a press go before SD traffic, everything else after it
+static void display_bus_acquire()
+{
+    odroid_spibus_acquire(ODROID_SPIBUS_LCD,
+        frame_timestamp ? ODROID_SPIBUS_PRIORITY_HIGH : ODROID_SPIBUS_PRIORITY_LOW);
+}
+
 static void send_reset_drawing(int left, int top, int width, int height)
 {
   esp_err_t ret;
 
+  display_bus_acquire();
+
   trans[0].tx_data[0]=0x2A;           //Column Address Set
   trans[1].tx_data[0]=(left) >> 8;              //Start Col High
   trans[1].tx_data[1]=(left) & 0xff;              //Start Col Low
@@ -201,6 +226,8 @@ static void send_reset_drawing(int left, int top, int width, int height)
   trans[3].tx_data[3]=(top + height - 1)&0xff;  //end page low
   trans[4].tx_data[0]=0x2C;           //memory write
 
+  frame_lines_remaining = height;
+
   // Queue all transactions.
   for (int x = 0; x < 5; x++) {
       ret=spi_device_queue_trans(spi, &trans[x], 1000 / portTICK_RATE_MS);
@@ -213,6 +240,8 @@ static void send_reset_drawing(int left, int top, int width, int height)
       ret=spi_device_get_trans_result(spi, &rtrans, 1000 / portTICK_RATE_MS);
       assert(ret==ESP_OK);
   }
+
+  odroid_spibus_release(ODROID_SPIBUS_LCD);
 }
 
 static void send_continue_line(uint16_t *line, int width, int lineCount)
@@ -229,6 +258,12 @@ static void send_continue_line(uint16_t *line, int width, int lineCount)
   trans[7].flags=0; //undo SPI_TRANS_USE_TXDATA flag
   trans[7].rxlength = 0;
 
+  frame_lines_remaining -= lineCount;
+
+  display_bus_acquire();
+
+  frame_last_line = (frame_lines_remaining <= 0);
+
   //Queue all transactions.
   for (int x = 6; x < 8; x++) {
       ret=spi_device_queue_trans(spi, &trans[x], 1000 / portTICK_RATE_MS);
@@ -241,6 +276,16 @@ static void send_continue_line(uint16_t *line, int width, int lineCount)
       ret=spi_device_get_trans_result(spi, &rtrans, portMAX_DELAY);
       assert(ret==ESP_OK);
   }
+
+  odroid_spibus_release(ODROID_SPIBUS_LCD);
+}
+
+// LEDC runs from APB and stops in light sleep. Once the fade is over the output is
+// parked at its idle level instead, which a sleeping chip keeps driving.
+static void backlight_fade_done(void* arg)
+{
+    ledc_stop(LEDC_LOW_SPEED_MODE, LEDC_CHANNEL_0, LCD_BACKLIGHT_ON_VALUE);
+    odroid_power_stay_awake(false);
 }
 
 static void backlight_init()
@@ -287,12 +332,27 @@ static void backlight_init()
     ledc_fade_func_install(0);
 
     // duty range is 0 ~ ((2**bit_num)-1)
+    odroid_power_stay_awake(true);
+
     ledc_set_fade_with_time(LEDC_LOW_SPEED_MODE, LEDC_CHANNEL_0, (LCD_BACKLIGHT_ON_VALUE) ? DUTY_MAX : 0, 500);
     ledc_fade_start(LEDC_LOW_SPEED_MODE, LEDC_CHANNEL_0, LEDC_FADE_NO_WAIT);
+
+    if (!backlight_timer)
+    {
+        esp_timer_create_args_t args = {
+            .callback = &backlight_fade_done,
+            .name = "backlight_fade"
+        };
+
+        if (esp_timer_create(&args, &backlight_timer) != ESP_OK) abort();
+    }
+
+    esp_timer_start_once(backlight_timer, 600 * 1000);
 }
 
 void backlight_deinit()
 {
+    if (backlight_timer) esp_timer_stop(backlight_timer);
     ledc_fade_func_uninstall();
     esp_err_t err = ledc_stop(LEDC_LOW_SPEED_MODE, LEDC_CHANNEL_0, 0);
     if (err != ESP_OK)
@@ -301,8 +361,16 @@ void backlight_deinit()
     }
 }
 
+// The next write that completes will report its latency against this input time
+void ili9341_set_frame_timestamp(int64_t timestamp)
+{
+    frame_timestamp = timestamp;
+}
+
 void ili9341_write_frame(uint16_t* buffer)
 {
+    odroid_power_performance_begin();
+
     short x, y;
 
     if (buffer == NULL)
@@ -331,10 +399,14 @@ void ili9341_write_frame(uint16_t* buffer)
             send_continue_line(buffer + y * displayWidth, displayWidth, 4);
         }
     }
+
+    odroid_power_performance_end();
 }
 
 void ili9341_write_frame_rectangle(short left, short top, short width, short height, uint16_t* buffer)
 {
+    odroid_power_performance_begin();
+
     short x, y;
 
     if (left < 0 || top < 0) abort();
@@ -365,10 +437,14 @@ void ili9341_write_frame_rectangle(short left, short top, short width, short hei
             if (alt > 1) alt = 0;
         }
     }
+
+    odroid_power_performance_end();
 }
 
 void ili9341_clear(uint16_t color)
 {
+    odroid_power_performance_begin();
+
     send_reset_drawing(0, 0, 320, 240);
 
     // clear the buffer
@@ -382,10 +458,14 @@ void ili9341_clear(uint16_t color)
     {
         send_continue_line(line[0], 320, 1);
     }
+
+    odroid_power_performance_end();
 }
 
 void ili9341_write_frame_rectangleLE(short left, short top, short width, short height, uint16_t* buffer)
 {
+    odroid_power_performance_begin();
+
     short x, y;
 
     if (left < 0 || top < 0) abort();
@@ -422,6 +502,8 @@ void ili9341_write_frame_rectangleLE(short left, short top, short width, short h
             if (alt > 1) alt = 0;
         }
     }
+
+    odroid_power_performance_end();
 }
 
 void ili9341_deinit()
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdint.h>
+
 void ili9341_init();
 void ili9341_deinit();
 void ili9341_write_frame(uint16_t* buffer);
@@ -7,5 +9,6 @@ void ili9341_write_frame_rectangle(short left, short top, short width, short hei
 void ili9341_write_frame_rectangleLE(short left, short top, short width, short height, uint16_t* buffer);
 
 void ili9341_clear(uint16_t color);
+void ili9341_set_frame_timestamp(int64_t timestamp);
 
 void backlight_deinit();
\ No newline at end of file
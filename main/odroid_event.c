@@ -0,0 +1,203 @@
+#include "odroid_event.h"
+
+#include "freertos/queue.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+#define EVENT_QUEUE_LENGTH (32)
+#define EVENT_TIMER_MAX (4)
+#define EVENT_DEFERRED_MAX (8)
+
+// Everything the UI reacts to goes through one queue: button events from
+// input.c, battery changes, background job results and timers. The UI blocks
+// on it and redraws only what an event actually changed.
+typedef struct
+{
+    int32_t id;
+    esp_timer_handle_t timer;
+} event_timer_t;
+
+static QueueHandle_t event_queue;
+static event_timer_t timers[EVENT_TIMER_MAX];
+static portMUX_TYPE timer_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Events a modal screen took off the queue but doesn't handle. Only the UI
+// task touches these, no lock.
+static odroid_event_t deferred[EVENT_DEFERRED_MAX];
+static int deferred_count = 0;
+
+
+static void event_timer_callback(void* arg)
+{
+    odroid_event_post_data(ODROID_EVENT_TIMER, (int32_t)arg, 0);
+}
+
+static event_timer_t* event_timer_get(int32_t id)
+{
+    event_timer_t* result = NULL;
+
+    portENTER_CRITICAL(&timer_lock);
+    for (int i = 0; i < EVENT_TIMER_MAX && !result; ++i)
+    {
+        if (timers[i].timer && timers[i].id == id) result = &timers[i];
+    }
+    portEXIT_CRITICAL(&timer_lock);
+
+    return result;
+}
+
+
+void odroid_event_init()
+{
+    if (event_queue) return;
+
+    event_queue = xQueueCreate(EVENT_QUEUE_LENGTH, sizeof(odroid_event_t));
+    if (!event_queue)
+    {
+        ESP_LOGE(__func__, "xQueueCreate failed.");
+        abort();
+    }
+}
+
+bool odroid_event_post(const odroid_event_t* event, int ticks)
+{
+    return xQueueSend(event_queue, event, (ticks < 0) ? portMAX_DELAY : ticks) == pdTRUE;
+}
+
+bool odroid_event_post_from_isr(const odroid_event_t* event, BaseType_t* woken)
+{
+    return xQueueSendFromISR(event_queue, event, woken) == pdTRUE;
+}
+
+bool odroid_event_post_data(uint8_t type, int32_t id, int32_t value)
+{
+    odroid_event_t event = {0};
+    event.type = type;
+    event.id = id;
+    event.value = value;
+
+    return odroid_event_post(&event, 0);
+}
+
+bool odroid_event_wait(odroid_event_t* out_event, int ticks)
+{
+    return xQueueReceive(event_queue, out_event, (ticks < 0) ? portMAX_DELAY : ticks) == pdTRUE;
+}
+
+bool odroid_event_peek(odroid_event_t* out_event)
+{
+    return xQueuePeek(event_queue, out_event, 0) == pdTRUE;
+}
+
+int odroid_event_pending()
+{
+    return uxQueueMessagesWaiting(event_queue);
+}
+
+void odroid_event_flush()
+{
+    xQueueReset(event_queue);
+}
+
+// Keeps an event for the main loop, see odroid_event_take_deferred(). Only
+// the latest of a kind is kept (battery level, a timer, a job result), job
+// stages with a negative value are kept one by one.
+void odroid_event_defer(const odroid_event_t* event)
+{
+    int i;
+
+    for (i = 0; i < deferred_count; ++i)
+    {
+        const odroid_event_t* e = &deferred[i];
+
+        if (e->type == event->type && e->id == event->id &&
+            (event->type != ODROID_EVENT_JOB || (e->value >= 0 && event->value >= 0)))
+        {
+            break;
+        }
+    }
+
+    if (i == deferred_count)
+    {
+        if (deferred_count == EVENT_DEFERRED_MAX)
+        {
+            ESP_LOGW(__func__, "full, dropping event type=%d id=%d.", deferred[0].type, deferred[0].id);
+            memmove(&deferred[0], &deferred[1], (EVENT_DEFERRED_MAX - 1) * sizeof(odroid_event_t));
+            deferred_count--;
+        }
+
+        i = deferred_count++;
+    }
+    else
+    {
+        // The newer one goes to the back, order is kept
+        memmove(&deferred[i], &deferred[i + 1], (deferred_count - i - 1) * sizeof(odroid_event_t));
+        i = deferred_count - 1;
+    }
+
+    deferred[i] = *event;
+}
+
+// Oldest deferred event, they all precede whatever is in the queue
+bool odroid_event_take_deferred(odroid_event_t* out_event)
+{
+    if (deferred_count < 1) return false;
+
+    *out_event = deferred[0];
+
+    deferred_count--;
+    memmove(&deferred[0], &deferred[1], deferred_count * sizeof(odroid_event_t));
+
+    return true;
+}
+
+// Posts ODROID_EVENT_TIMER with the given id, restarting the timer if it is already running
+void odroid_event_timer_start(int32_t id, uint32_t ms, bool periodic)
+{
+    event_timer_t* slot = event_timer_get(id);
+
+    if (!slot)
+    {
+        portENTER_CRITICAL(&timer_lock);
+        for (int i = 0; i < EVENT_TIMER_MAX && !slot; ++i)
+        {
+            if (!timers[i].timer) slot = &timers[i];
+        }
+        portEXIT_CRITICAL(&timer_lock);
+
+        if (!slot)
+        {
+            ESP_LOGE(__func__, "no free timer for id %d.", id);
+            abort();
+        }
+
+        esp_timer_handle_t timer;
+        esp_timer_create_args_t args = {
+            .callback = &event_timer_callback,
+            .arg = (void*)id,
+            .name = "event_timer"
+        };
+
+        if (esp_timer_create(&args, &timer) != ESP_OK) abort();
+
+        slot->id = id;
+        slot->timer = timer;
+    }
+    else
+    {
+        esp_timer_stop(slot->timer);
+    }
+
+    if (periodic) esp_timer_start_periodic(slot->timer, ms * 1000);
+    else esp_timer_start_once(slot->timer, ms * 1000);
+}
+
+void odroid_event_timer_stop(int32_t id)
+{
+    event_timer_t* slot = event_timer_get(id);
+    if (slot) esp_timer_stop(slot->timer);
+}
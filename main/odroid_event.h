@@ -0,0 +1,36 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+#include "input.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+enum
+{
+    ODROID_EVENT_INPUT = 0,
+    ODROID_EVENT_BATTERY,
+    ODROID_EVENT_JOB,
+    ODROID_EVENT_TIMER,
+};
+
+typedef struct odroid_event
+{
+    uint8_t type;
+    int32_t id; // job or timer id
+    int32_t value; // battery percent, job result
+    odroid_input_event_t input;
+} odroid_event_t;
+
+void odroid_event_init();
+bool odroid_event_post(const odroid_event_t* event, int ticks);
+bool odroid_event_post_from_isr(const odroid_event_t* event, BaseType_t* woken);
+bool odroid_event_post_data(uint8_t type, int32_t id, int32_t value);
+bool odroid_event_wait(odroid_event_t* out_event, int ticks);
+bool odroid_event_peek(odroid_event_t* out_event);
+int odroid_event_pending();
+void odroid_event_flush();
+void odroid_event_defer(const odroid_event_t* event);
+bool odroid_event_take_deferred(odroid_event_t* out_event);
+void odroid_event_timer_start(int32_t id, uint32_t ms, bool periodic);
+void odroid_event_timer_stop(int32_t id);
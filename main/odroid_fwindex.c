@@ -0,0 +1,585 @@
+#include "odroid_fwindex.h"
+#include "odroid_sdcard.h"
+#include "odroid_event.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+#define FWINDEX_FILE_NAME ".fwindex"
+#define FWINDEX_TEMP_NAME ".fwindex.tmp"
+#define FWINDEX_MAGIC "FWIX"
+#define FWINDEX_VERSION (2)
+#define FWINDEX_PROGRESS_EVERY (4)
+#define FWINDEX_PROGRESS_QUEUED_MAX (4)
+
+#define FWINDEX_LISTED (-2)
+#define FWINDEX_DONE (-1)
+
+
+// File layout: header, entries[count], names (NUL separated), details[count].
+// Everything but the details is read in one go, details (tile, partition
+// layout) are read per visible row or install.
+typedef struct
+{
+    char magic[4];
+    uint16_t version;
+    uint16_t entrySize;
+    uint32_t detailSize;
+    uint32_t count;
+    uint32_t namesSize;
+} fwindex_header_t;
+
+// A listing and its name lookup. names is one block, the pointer array
+// followed by the strings, like odroid_sdcard_files_get() returns.
+typedef struct
+{
+    int count;
+    char** names;
+    odroid_fwindex_entry_t* entries;
+    uint32_t namesSize;
+    int* slots; // entry per name hash, open addressing, -1 = empty
+    uint32_t slotMask;
+} fwindex_listing_t;
+
+// The indexer scans the folder, publishes the sorted listing with the new
+// or changed files marked pending, then probes those and writes the new
+// index to the temp file. Events on job_id: FWINDEX_LISTED, the number of
+// files probed so far, then FWINDEX_DONE. The UI picks up each stage with
+// odroid_fwindex_update().
+typedef struct fwindex_refresh
+{
+    char* path;
+    size_t detailSize;
+    odroid_fwindex_probe_t probe;
+    int32_t jobId;
+
+    const fwindex_listing_t* previous;
+    long previousDetails;
+
+    fwindex_listing_t result;
+    int* source; // detail record in the previous file, -1 if probed
+    long detailsOffset;
+    bool changed;
+    bool saved;
+
+    volatile bool listed;
+    volatile bool cancel;
+    volatile bool done;
+} fwindex_refresh_t;
+
+
+// Listing the index points to once final, the saved one before that
+static fwindex_listing_t listing;
+
+
+static uint32_t fwindex_hash(const char* name)
+{
+    uint32_t hash = 2166136261u; // FNV-1a
+
+    while (*name)
+    {
+        hash = (hash ^ (uint8_t)*name++) * 16777619u;
+    }
+
+    return hash;
+}
+
+static long fwindex_details_offset(uint32_t count, uint32_t namesSize)
+{
+    return sizeof(fwindex_header_t) + count * sizeof(odroid_fwindex_entry_t) + namesSize;
+}
+
+static char* fwindex_path(const char* path, const char* name)
+{
+    char* result = malloc(strlen(path) + 1 + strlen(name) + 1);
+    if (!result) abort();
+
+    sprintf(result, "%s/%s", path, name);
+    return result;
+}
+
+static void fwindex_listing_free(fwindex_listing_t* listing)
+{
+    free(listing->names);
+    free(listing->entries);
+    free(listing->slots);
+
+    memset(listing, 0, sizeof(*listing));
+}
+
+static void fwindex_listing_hash(fwindex_listing_t* listing)
+{
+    listing->slotMask = 15;
+    while (listing->slotMask < listing->count * 2) listing->slotMask = (listing->slotMask << 1) | 1;
+
+    listing->slots = malloc((listing->slotMask + 1) * sizeof(int));
+    if (!listing->slots) abort();
+
+    memset(listing->slots, 0xff, (listing->slotMask + 1) * sizeof(int));
+
+    for (int i = 0; i < listing->count; ++i)
+    {
+        uint32_t slot = fwindex_hash(listing->names[i]);
+        while (listing->slots[slot & listing->slotMask] >= 0) slot++;
+
+        listing->slots[slot & listing->slotMask] = i;
+    }
+}
+
+static int fwindex_listing_find(const fwindex_listing_t* listing, const char* name)
+{
+    if (!listing->slots) return -1;
+
+    for (uint32_t slot = fwindex_hash(name); ; slot++)
+    {
+        int i = listing->slots[slot & listing->slotMask];
+
+        if (i < 0) return -1;
+        if (strcmp(listing->names[i], name) == 0) return i;
+    }
+}
+
+static bool fwindex_listing_load(FILE* file, size_t detailSize, fwindex_listing_t* listing)
+{
+    fwindex_header_t header;
+
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, FWINDEX_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != FWINDEX_VERSION ||
+        header.entrySize != sizeof(odroid_fwindex_entry_t) ||
+        header.detailSize != detailSize)
+    {
+        ESP_LOGW(__func__, "unknown index format, rebuilding.");
+        return false;
+    }
+
+    // The counts come from the card, they must account for the whole file
+    // before anything is allocated from them
+    long fileSize = -1;
+    if (fseek(file, 0, SEEK_END) == 0) fileSize = ftell(file);
+
+    uint64_t expectedSize = sizeof(header) + (uint64_t)header.count * (sizeof(odroid_fwindex_entry_t) + detailSize) +
+        header.namesSize;
+
+    if (fileSize < 0 || expectedSize != (uint64_t)fileSize || fseek(file, sizeof(header), SEEK_SET) != 0)
+    {
+        ESP_LOGW(__func__, "index size mismatch, rebuilding.");
+        return false;
+    }
+
+    uint32_t count = header.count;
+
+    listing->count = count;
+    listing->namesSize = header.namesSize;
+    listing->entries = malloc(count * sizeof(odroid_fwindex_entry_t) + 1);
+    listing->names = malloc(count * sizeof(char*) + header.namesSize + 1);
+    if (!listing->entries || !listing->names)
+    {
+        ESP_LOGW(__func__, "index too large (%d entries), rebuilding.", count);
+        fwindex_listing_free(listing);
+        return false;
+    }
+
+    char* names = (char*)(listing->names + count);
+
+    if (fread(listing->entries, sizeof(odroid_fwindex_entry_t), count, file) != count ||
+        fread(names, 1, header.namesSize, file) != header.namesSize)
+    {
+        ESP_LOGW(__func__, "index truncated, rebuilding.");
+        fwindex_listing_free(listing);
+        return false;
+    }
+
+    names[header.namesSize] = 0;
+
+    for (int i = 0; i < count; ++i)
+    {
+        if (listing->entries[i].nameOffset >= header.namesSize || listing->entries[i].pending)
+        {
+            ESP_LOGW(__func__, "index corrupted, rebuilding.");
+            fwindex_listing_free(listing);
+            return false;
+        }
+
+        listing->names[i] = names + listing->entries[i].nameOffset;
+    }
+
+    fwindex_listing_hash(listing);
+
+    return true;
+}
+
+static void fwindex_post(fwindex_refresh_t* refresh, int32_t value)
+{
+    // Progress is dropped rather than filling the queue ahead of input
+    if (value >= 0 && odroid_event_pending() >= FWINDEX_PROGRESS_QUEUED_MAX) return;
+
+    odroid_event_t event = {0};
+    event.type = ODROID_EVENT_JOB;
+    event.id = refresh->jobId;
+    event.value = value;
+
+    // Stage events must arrive, unless nobody is listening any more
+    while (!odroid_event_post(&event, 10 / portTICK_PERIOD_MS) && value < 0 && !refresh->cancel);
+}
+
+// Writes the index to the temporary file. Details of unchanged files are
+// copied from the previous index, pending files are probed and published
+// one by one. Entries are completed even when writing fails so that the
+// listing still works.
+static bool fwindex_write(fwindex_refresh_t* refresh)
+{
+    fwindex_listing_t* result = &refresh->result;
+
+    char* tempPath = fwindex_path(refresh->path, FWINDEX_TEMP_NAME);
+    FILE* file = fopen(tempPath, "wb");
+    bool ok = (file != NULL);
+
+    // Own handle on the previous index, the UI keeps reading from it
+    char* indexPath = fwindex_path(refresh->path, FWINDEX_FILE_NAME);
+    FILE* previousFile = fopen(indexPath, "rb");
+    free(indexPath);
+
+    void* detail = malloc(refresh->detailSize);
+    if (!detail) abort();
+
+    fwindex_header_t header;
+    memcpy(header.magic, FWINDEX_MAGIC, sizeof(header.magic));
+    header.version = FWINDEX_VERSION;
+    header.entrySize = sizeof(odroid_fwindex_entry_t);
+    header.detailSize = refresh->detailSize;
+    header.count = result->count;
+    header.namesSize = result->namesSize;
+
+    // Entries are written again once the pending ones are filled in
+    if (ok)
+    {
+        ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+            fwrite(result->entries, sizeof(odroid_fwindex_entry_t), result->count, file) == result->count;
+
+        for (int i = 0; ok && i < result->count; ++i)
+        {
+            ok = fwrite(result->names[i], strlen(result->names[i]) + 1, 1, file) == 1;
+        }
+    }
+
+    int probed = 0;
+
+    for (int i = 0; i < result->count && !refresh->cancel; ++i)
+    {
+        odroid_fwindex_entry_t* entry = &result->entries[i];
+        int source = refresh->source[i];
+        bool copied = false;
+
+        if (source >= 0 && previousFile)
+        {
+            copied = fseek(previousFile, refresh->previousDetails + source * refresh->detailSize, SEEK_SET) == 0 &&
+                fread(detail, refresh->detailSize, 1, previousFile) == 1;
+        }
+
+        if (!copied)
+        {
+            char* fwPath = fwindex_path(refresh->path, result->names[i]);
+            odroid_fwindex_entry_t fresh;
+
+            // The probe sees the file size and date, the rest is filled in
+            memset(&fresh, 0, sizeof(fresh));
+            memset(detail, 0, refresh->detailSize);
+            fresh.nameOffset = entry->nameOffset;
+            fresh.fileSize = entry->fileSize;
+            fresh.mtime = entry->mtime;
+
+            fresh.valid = refresh->probe(fwPath, &fresh, detail);
+            fresh.pending = 1;
+
+            // The UI reads the entry as soon as pending is cleared
+            *entry = fresh;
+            __asm__("memw");
+            entry->pending = 0;
+
+            free(fwPath);
+
+            if (++probed % FWINDEX_PROGRESS_EVERY == 0) fwindex_post(refresh, probed);
+        }
+
+        if (ok) ok = fwrite(detail, refresh->detailSize, 1, file) == 1;
+    }
+
+    if (ok && !refresh->cancel)
+    {
+        ok = fseek(file, sizeof(header), SEEK_SET) == 0 &&
+            fwrite(result->entries, sizeof(odroid_fwindex_entry_t), result->count, file) == result->count;
+    }
+
+    if (previousFile) fclose(previousFile);
+    if (file && fclose(file) != 0) ok = false;
+    if ((!ok || refresh->cancel) && file) remove(tempPath);
+
+    refresh->detailsOffset = fwindex_details_offset(header.count, header.namesSize);
+
+    ESP_LOGI(__func__, "%d entries, %d probed, %s", result->count, probed,
+        refresh->cancel ? "cancelled" : ok ? "saved" : "not saved");
+
+    free(detail);
+    free(tempPath);
+
+    return ok && !refresh->cancel;
+}
+
+static void fwindex_refresh_task(void* arg)
+{
+    fwindex_refresh_t* refresh = (fwindex_refresh_t*)arg;
+    fwindex_listing_t* result = &refresh->result;
+    const fwindex_listing_t* old = refresh->previous;
+
+    const int64_t start = esp_timer_get_time();
+
+    // An empty folder gives count 0 and no names block, the entries still
+    // get one element so a published listing is never NULL
+    odroid_sdcard_file_info_t* info = NULL;
+    result->count = odroid_sdcard_files_get_info(refresh->path, ".fw", &result->names, &info);
+
+    result->entries = calloc(result->count + 1, sizeof(odroid_fwindex_entry_t));
+    refresh->source = malloc((result->count + 1) * sizeof(int));
+    if (!result->entries || !refresh->source) abort();
+
+    bool changed = (old->count != result->count) || (old->entries == NULL);
+
+    for (int i = 0; i < result->count; ++i)
+    {
+        odroid_fwindex_entry_t* entry = &result->entries[i];
+        int j = fwindex_listing_find(old, result->names[i]);
+
+        if (j >= 0 && old->entries[j].fileSize == info[i].size && old->entries[j].mtime == info[i].mtime)
+        {
+            *entry = old->entries[j];
+        }
+        else
+        {
+            j = -1;
+            entry->fileSize = info[i].size;
+            entry->mtime = info[i].mtime;
+            entry->pending = 1;
+        }
+
+        entry->nameOffset = result->namesSize;
+        result->namesSize += strlen(result->names[i]) + 1;
+
+        refresh->source[i] = j;
+        if (j != i) changed = true;
+    }
+
+    refresh->changed = changed;
+
+    if (changed)
+    {
+        // The previous listing is not touched after this point
+        refresh->previousDetails = fwindex_details_offset(old->count, old->namesSize);
+
+        __asm__("memw");
+        refresh->listed = true;
+        fwindex_post(refresh, FWINDEX_LISTED);
+
+        refresh->saved = fwindex_write(refresh);
+    }
+
+    ESP_LOGI(__func__, "%d files, %s, %lld ms", result->count, changed ? "updated" : "up to date",
+        (esp_timer_get_time() - start) / 1000);
+
+    fwindex_post(refresh, FWINDEX_DONE);
+
+    __asm__("memw");
+    refresh->done = true;
+
+    vTaskDelete(NULL);
+}
+
+
+// Lists the .fw files of path from the saved index, which takes a single
+// sequential read, and starts the indexer at low priority to check it
+// against the folder. detail_size is the size of the probe's detail record.
+void odroid_fwindex_open(odroid_fwindex_t* index, const char* path, size_t detail_size, odroid_fwindex_probe_t probe, int32_t job_id)
+{
+    memset(index, 0, sizeof(*index));
+
+    index->path = strdup(path);
+    index->detailSize = detail_size;
+    index->probe = probe;
+    if (!index->path) abort();
+
+    char* indexPath = fwindex_path(path, FWINDEX_FILE_NAME);
+
+    fwindex_listing_free(&listing);
+
+    FILE* file = fopen(indexPath, "rb");
+    if (file && !fwindex_listing_load(file, detail_size, &listing))
+    {
+        fclose(file);
+        file = NULL;
+    }
+
+    free(indexPath);
+
+    index->count = listing.count;
+    index->names = listing.names;
+    index->entries = listing.entries;
+    index->file = file;
+    index->detailsOffset = fwindex_details_offset(listing.count, listing.namesSize);
+
+    fwindex_refresh_t* refresh = calloc(1, sizeof(fwindex_refresh_t));
+    if (!refresh) abort();
+
+    refresh->path = index->path;
+    refresh->detailSize = detail_size;
+    refresh->probe = probe;
+    refresh->jobId = job_id;
+    refresh->previous = &listing;
+    index->refresh = refresh;
+
+    // Below the UI and input, on the core that doesn't run the UI
+    xTaskCreatePinnedToCore(&fwindex_refresh_task, "fwindex", 1024 * 4, refresh, tskIDLE_PRIORITY + 1, NULL, 1);
+
+    ESP_LOGI(__func__, "%d saved entries, indexing.", index->count);
+}
+
+// Takes over whatever the indexer has published so far. Returns true if
+// names and entries were replaced, item numbers are then different.
+bool odroid_fwindex_update(odroid_fwindex_t* index)
+{
+    fwindex_refresh_t* refresh = index->refresh;
+    bool replaced = false;
+
+    if (!refresh) return false;
+
+    // Sorted listing with the pending files, details of the others are
+    // still read from the previous file
+    if (refresh->listed && index->entries != refresh->result.entries)
+    {
+        __asm__("memw");
+
+        index->count = refresh->result.count;
+        index->names = refresh->result.names;
+        index->entries = refresh->result.entries;
+        index->detailSlots = refresh->source;
+
+        replaced = true;
+    }
+
+    if (!refresh->done) return replaced;
+
+    __asm__("memw");
+
+    if (refresh->changed)
+    {
+        // The old file can only go once nothing reads from it
+        if (index->file) fclose(index->file);
+        index->file = NULL;
+        index->detailSlots = NULL;
+
+        if (refresh->saved)
+        {
+            char* indexPath = fwindex_path(index->path, FWINDEX_FILE_NAME);
+            char* tempPath = fwindex_path(index->path, FWINDEX_TEMP_NAME);
+
+            // FAT rename does not replace an existing file
+            remove(indexPath);
+            if (rename(tempPath, indexPath) == 0)
+            {
+                index->file = fopen(indexPath, "rb");
+                index->detailsOffset = refresh->detailsOffset;
+            }
+
+            free(tempPath);
+            free(indexPath);
+        }
+
+        fwindex_listing_free(&listing);
+        listing = refresh->result;
+        fwindex_listing_hash(&listing);
+    }
+    else
+    {
+        fwindex_listing_free(&refresh->result);
+    }
+
+    free(refresh->source);
+    free(refresh);
+
+    index->refresh = NULL;
+    index->final = true;
+
+    return replaced;
+}
+
+int odroid_fwindex_find(odroid_fwindex_t* index, const char* name)
+{
+    if (index->names == listing.names) return fwindex_listing_find(&listing, name);
+
+    for (int i = 0; i < index->count; ++i)
+    {
+        if (strcmp(index->names[i], name) == 0) return i;
+    }
+
+    return -1;
+}
+
+// Returns false for invalid and pending files, detail is zeroed then
+bool odroid_fwindex_read_detail(odroid_fwindex_t* index, int item, void* detail)
+{
+    if (item < 0 || item >= index->count || index->entries[item].pending || !index->entries[item].valid)
+    {
+        memset(detail, 0, index->detailSize);
+        return false;
+    }
+
+    __asm__("memw");
+
+    int slot = index->detailSlots ? index->detailSlots[item] : item;
+
+    if (index->file && slot >= 0)
+    {
+        if (fseek(index->file, index->detailsOffset + slot * index->detailSize, SEEK_SET) == 0 &&
+            fread(detail, index->detailSize, 1, index->file) == 1)
+        {
+            return true;
+        }
+    }
+
+    // Probed after the listing was published, or no usable index file
+    // (read-only or full card), go to the firmware itself
+    odroid_fwindex_entry_t entry = index->entries[item];
+    char* fwPath = fwindex_path(index->path, index->names[item]);
+    bool ret = index->probe(fwPath, &entry, detail);
+
+    free(fwPath);
+    return ret;
+}
+
+void odroid_fwindex_close(odroid_fwindex_t* index)
+{
+    fwindex_refresh_t* refresh = index->refresh;
+
+    if (refresh)
+    {
+        // The indexer stops after the file it is probing
+        refresh->cancel = true;
+        while (!refresh->done) vTaskDelay(1);
+
+        fwindex_listing_free(&refresh->result);
+        free(refresh->source);
+        free(refresh);
+    }
+
+    if (index->file) fclose(index->file);
+
+    fwindex_listing_free(&listing);
+    free(index->path);
+
+    memset(index, 0, sizeof(*index));
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#define ODROID_FWINDEX_DESCRIPTION_SIZE (40)
+
+typedef struct
+{
+    uint32_t fileSize;
+    uint32_t mtime;
+    uint32_t flashSize;
+    uint32_t checksum;
+    uint8_t partsCount;
+    uint8_t valid;
+    volatile uint8_t pending; // not probed yet, the other fields are not set
+    uint8_t _reserved0;
+    uint32_t nameOffset; // in the index file only
+    char description[ODROID_FWINDEX_DESCRIPTION_SIZE];
+} odroid_fwindex_entry_t;
+
+// Parses a .fw file into entry and the caller defined detail record, returns
+// false if it is not valid firmware. entry->fileSize and entry->mtime are
+// already set. Called from the indexer task.
+typedef bool (*odroid_fwindex_probe_t)(const char* path, odroid_fwindex_entry_t* entry, void* detail);
+
+struct fwindex_refresh;
+
+typedef struct
+{
+    int count;
+    char** names; // same order as odroid_sdcard_files_get()
+    odroid_fwindex_entry_t* entries;
+    bool final; // false until the indexer has checked the listing against the folder
+    FILE* file;
+    long detailsOffset;
+    const int* detailSlots; // detail record of each item in file, NULL if in order
+    char* path;
+    size_t detailSize;
+    odroid_fwindex_probe_t probe;
+    struct fwindex_refresh* refresh;
+} odroid_fwindex_t;
+
+void odroid_fwindex_open(odroid_fwindex_t* index, const char* path, size_t detail_size, odroid_fwindex_probe_t probe, int32_t job_id);
+bool odroid_fwindex_update(odroid_fwindex_t* index);
+int odroid_fwindex_find(odroid_fwindex_t* index, const char* name);
+bool odroid_fwindex_read_detail(odroid_fwindex_t* index, int item, void* detail);
+void odroid_fwindex_close(odroid_fwindex_t* index);
@@ -0,0 +1,92 @@
+#include "odroid_initials.h"
+
+#include "esp_log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+
+// Digits and symbols share one run marker
+static char initial_key(const char* name)
+{
+    int c = (name && name[0]) ? (unsigned char)name[0] : 0;
+    return isalpha(c) ? toupper(c) : '#';
+}
+
+
+// Splits the list into runs of items with the same initial. The list is not
+// required to be sorted, an unsorted list simply produces more and shorter runs.
+void odroid_initials_build(odroid_initials_t* initials, int itemCount, odroid_initials_name_t name, void* arg)
+{
+    odroid_initials_free(initials);
+
+    if (itemCount < 1) return;
+
+    initials->keys = malloc(itemCount * sizeof(char));
+    initials->starts = malloc(itemCount * sizeof(int));
+    if (!initials->keys || !initials->starts) abort();
+
+    for (int i = 0; i < itemCount; ++i)
+    {
+        char key = initial_key(name(arg, i));
+
+        if (initials->count == 0 || initials->keys[initials->count - 1] != key)
+        {
+            initials->keys[initials->count] = key;
+            initials->starts[initials->count] = i;
+            initials->count++;
+        }
+    }
+
+    ESP_LOGD(__func__, "%d items, %d runs", itemCount, initials->count);
+}
+
+void odroid_initials_free(odroid_initials_t* initials)
+{
+    free(initials->keys);
+    free(initials->starts);
+
+    memset(initials, 0, sizeof(*initials));
+}
+
+// Returns the run containing item
+int odroid_initials_find(const odroid_initials_t* initials, int item)
+{
+    int low = 0;
+    int high = initials->count - 1;
+
+    if (high < 0) return -1;
+
+    // Last run starting at or before item
+    while (low < high)
+    {
+        int mid = (low + high + 1) / 2;
+
+        if (initials->starts[mid] <= item) low = mid;
+        else high = mid - 1;
+    }
+
+    return low;
+}
+
+// Returns the first item of the next (direction > 0) or previous run, wrapping
+// around. Going back from inside a run stops at its first item first.
+int odroid_initials_jump(const odroid_initials_t* initials, int item, int direction, char* out_key)
+{
+    int run = odroid_initials_find(initials, item);
+    if (run < 0) return item;
+
+    if (direction > 0)
+    {
+        if (++run >= initials->count) run = 0;
+    }
+    else if (initials->starts[run] == item)
+    {
+        if (--run < 0) run = initials->count - 1;
+    }
+
+    if (out_key) *out_key = initials->keys[run];
+
+    return initials->starts[run];
+}
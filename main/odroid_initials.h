@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdint.h>
+
+// Returns the name of item 'index', used to build the index
+typedef const char* (*odroid_initials_name_t)(void* arg, int index);
+
+typedef struct
+{
+    int count;
+    char* keys; // display letter of each run
+    int* starts; // first item of each run, ascending
+} odroid_initials_t;
+
+void odroid_initials_build(odroid_initials_t* initials, int itemCount, odroid_initials_name_t name, void* arg);
+void odroid_initials_free(odroid_initials_t* initials);
+int odroid_initials_find(const odroid_initials_t* initials, int item);
+int odroid_initials_jump(const odroid_initials_t* initials, int item, int direction, char* out_key);
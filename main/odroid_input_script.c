@@ -0,0 +1,130 @@
+#include "odroid_input_script.h"
+
+#include "esp_log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+
+// Plain text, one event per line, so scripts can also be written by hand or generated:
+//
+//   # <microseconds since start> <button> <down|up|repeat>
+//   0 DOWN down
+//   120000 DOWN up
+//
+// Nothing here touches the hardware, only stdio and logging.
+
+#define SCRIPT_INITIAL_CAPACITY (256)
+
+static const char* button_names[ODROID_INPUT_MAX] = {
+    "UP", "RIGHT", "DOWN", "LEFT", "SELECT", "START", "A", "B", "MENU", "VOLUME"
+};
+
+
+static int parse_button(const char* name)
+{
+    for (int i = 0; i < ODROID_INPUT_MAX; ++i)
+    {
+        if (strcasecmp(name, button_names[i]) == 0) return i;
+    }
+
+    return -1;
+}
+
+int odroid_input_script_load(const char* path, odroid_input_event_t** out_events)
+{
+    FILE* file = fopen(path, "r");
+    if (!file) return -1;
+
+    int capacity = SCRIPT_INITIAL_CAPACITY;
+    int count = 0;
+    odroid_input_event_t* events = malloc(capacity * sizeof(odroid_input_event_t));
+    if (!events) abort();
+
+    char line[96];
+    int lineNumber = 0;
+
+    while (fgets(line, sizeof(line), file))
+    {
+        ++lineNumber;
+
+        char* p = line;
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '#' || *p == '\n' || *p == '\r' || *p == 0) continue;
+
+        long long timestamp;
+        char button[16];
+        char action[16];
+
+        if (sscanf(p, "%lld %15s %15s", &timestamp, button, action) != 3)
+        {
+            ESP_LOGE(__func__, "%s:%d: malformed event", path, lineNumber);
+            goto script_load_fail;
+        }
+
+        int index = parse_button(button);
+        if (index < 0)
+        {
+            ESP_LOGE(__func__, "%s:%d: unknown button '%s'", path, lineNumber, button);
+            goto script_load_fail;
+        }
+
+        odroid_input_event_t event = {index, 1, 0, timestamp};
+
+        if (strcasecmp(action, "up") == 0) event.pressed = 0;
+        else if (strcasecmp(action, "repeat") == 0) event.repeat = 1;
+        else if (strcasecmp(action, "down") != 0)
+        {
+            ESP_LOGE(__func__, "%s:%d: unknown action '%s'", path, lineNumber, action);
+            goto script_load_fail;
+        }
+
+        if (count > 0 && timestamp < events[count - 1].timestamp)
+        {
+            ESP_LOGE(__func__, "%s:%d: events are not in order", path, lineNumber);
+            goto script_load_fail;
+        }
+
+        if (count == capacity)
+        {
+            capacity *= 2;
+            events = realloc(events, capacity * sizeof(odroid_input_event_t));
+            if (!events) abort();
+        }
+
+        events[count++] = event;
+    }
+
+    fclose(file);
+
+    *out_events = events;
+    return count;
+
+script_load_fail:
+    fclose(file);
+    free(events);
+    return -1;
+}
+
+int odroid_input_script_save(const char* path, const odroid_input_event_t* events, int count)
+{
+    FILE* file = fopen(path, "w");
+    if (!file) return -1;
+
+    fprintf(file, "# odroid-go input script\n# <microseconds since start> <button> <down|up|repeat>\n");
+
+    for (int i = 0; i < count; ++i)
+    {
+        const odroid_input_event_t* event = &events[i];
+        const char* action = !event->pressed ? "up" : (event->repeat ? "repeat" : "down");
+
+        fprintf(file, "%lld %s %s\n", (long long)event->timestamp, button_names[event->button], action);
+    }
+
+    int ret = ferror(file) ? -1 : count;
+    if (fclose(file) != 0) ret = -1;
+
+    return ret;
+}
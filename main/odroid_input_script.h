@@ -0,0 +1,6 @@
+#pragma once
+
+#include "input.h"
+
+int odroid_input_script_load(const char* path, odroid_input_event_t** out_events);
+int odroid_input_script_save(const char* path, const odroid_input_event_t* events, int count);
@@ -0,0 +1,182 @@
+#include "odroid_jpeg.h"
+#include "odroid_display.h"
+
+#include "esp_log.h"
+#include "rom/tjpgd.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+// The ROM decoder needs at least 3100 bytes of work area
+#define JPEG_WORK_SIZE (3100)
+
+
+typedef struct
+{
+    FILE* file;
+    odroid_jpeg_cancel_t cancel;
+
+    // One MCU row of output, clipped to the visible width
+    uint16_t* band;
+    short bandTop;
+    short bandBottom;
+    short bandHeight;
+
+    // Visible window on screen and its offset inside the scaled image
+    short left;
+    short top;
+    short width;
+    short height;
+    short cropX;
+    short cropY;
+} jpeg_context_t;
+
+
+static UINT jpeg_input(JDEC* jd, BYTE* buf, UINT len)
+{
+    jpeg_context_t* ctx = (jpeg_context_t*)jd->device;
+
+    if (!buf)
+    {
+        // Skip data
+        return (fseek(ctx->file, len, SEEK_CUR) == 0) ? len : 0;
+    }
+
+    return fread(buf, 1, len, ctx->file);
+}
+
+static void jpeg_flush_band(jpeg_context_t* ctx)
+{
+    if (ctx->bandTop < 0) return;
+
+    short first = ctx->bandTop;
+    short last = ctx->bandBottom;
+
+    if (first < ctx->cropY) first = ctx->cropY;
+    if (last > ctx->cropY + ctx->height - 1) last = ctx->cropY + ctx->height - 1;
+
+    if (first <= last)
+    {
+        ili9341_write_frame_rectangleLE(ctx->left, ctx->top + (first - ctx->cropY),
+            ctx->width, last - first + 1, ctx->band + (first - ctx->bandTop) * ctx->width);
+    }
+
+    ctx->bandTop = -1;
+}
+
+static UINT jpeg_output(JDEC* jd, void* bitmap, JRECT* rect)
+{
+    jpeg_context_t* ctx = (jpeg_context_t*)jd->device;
+
+    if (ctx->cancel && ctx->cancel())
+    {
+        return 0;
+    }
+
+    // Blocks arrive left to right, one MCU row at a time
+    if (rect->top != ctx->bandTop)
+    {
+        jpeg_flush_band(ctx);
+        ctx->bandTop = rect->top;
+        ctx->bandBottom = rect->top;
+    }
+
+    if (rect->bottom > ctx->bandBottom) ctx->bandBottom = rect->bottom;
+
+    const BYTE* src = (const BYTE*)bitmap;
+
+    for (int y = rect->top; y <= rect->bottom; ++y)
+    {
+        int row = y - ctx->bandTop;
+        bool visible = (row < ctx->bandHeight) && (y >= ctx->cropY) && (y < ctx->cropY + ctx->height);
+
+        for (int x = rect->left; x <= rect->right; ++x, src += 3)
+        {
+            int col = x - ctx->cropX;
+            if (!visible || col < 0 || col >= ctx->width) continue;
+
+            // RGB888 -> RGB565
+            ctx->band[row * ctx->width + col] = ((src[0] & 0xf8) << 8) | ((src[1] & 0xfc) << 3) | (src[2] >> 3);
+        }
+    }
+
+    return 1;
+}
+
+esp_err_t odroid_jpeg_draw_file(const char* path, short left, short top, short maxWidth, short maxHeight, odroid_jpeg_cancel_t cancel)
+{
+    esp_err_t ret = ESP_FAIL;
+
+    if (maxWidth < 1 || maxHeight < 1) abort();
+
+    FILE* file = fopen(path, "rb");
+    if (!file)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    jpeg_context_t ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.file = file;
+    ctx.cancel = cancel;
+    ctx.bandTop = -1;
+
+    void* work = malloc(JPEG_WORK_SIZE);
+    if (!work) abort();
+
+    JDEC jd;
+    JRESULT res = jd_prepare(&jd, jpeg_input, work, JPEG_WORK_SIZE, &ctx);
+    if (res != JDR_OK)
+    {
+        ESP_LOGE(__func__, "jd_prepare failed (%d): %s", res, path);
+        goto jpeg_draw_file_done;
+    }
+
+    // Use the largest size that fits, crop around the center if even 1/8 is too big
+    BYTE scale = 0;
+    while (scale < 3 && ((jd.width >> scale) > maxWidth || (jd.height >> scale) > maxHeight))
+    {
+        ++scale;
+    }
+
+    short imageWidth = jd.width >> scale;
+    short imageHeight = jd.height >> scale;
+
+    ctx.width = (imageWidth < maxWidth) ? imageWidth : maxWidth;
+    ctx.height = (imageHeight < maxHeight) ? imageHeight : maxHeight;
+    ctx.cropX = (imageWidth - ctx.width) / 2;
+    ctx.cropY = (imageHeight - ctx.height) / 2;
+    ctx.left = left + (maxWidth - ctx.width) / 2;
+    ctx.top = top + (maxHeight - ctx.height) / 2;
+
+    ctx.bandHeight = (jd.msy * 8) >> scale;
+    if (ctx.bandHeight < 1) ctx.bandHeight = 1;
+
+    if (ctx.width < 1 || ctx.height < 1)
+    {
+        goto jpeg_draw_file_done;
+    }
+
+    ctx.band = malloc(ctx.width * ctx.bandHeight * sizeof(uint16_t));
+    if (!ctx.band) abort();
+
+    res = jd_decomp(&jd, jpeg_output, scale);
+    if (res == JDR_OK)
+    {
+        jpeg_flush_band(&ctx);
+        ret = ESP_OK;
+    }
+    else if (res != JDR_INTR)
+    {
+        ESP_LOGE(__func__, "jd_decomp failed (%d): %s", res, path);
+    }
+
+jpeg_draw_file_done:
+    free(ctx.band);
+    free(work);
+    fclose(file);
+
+    return ret;
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include "esp_err.h"
+#include <stdbool.h>
+
+typedef bool (*odroid_jpeg_cancel_t)(void);
+
+esp_err_t odroid_jpeg_draw_file(const char* path, short left, short top, short maxWidth, short maxHeight, odroid_jpeg_cancel_t cancel);
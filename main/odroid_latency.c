@@ -0,0 +1,147 @@
+#include "odroid_latency.h"
+
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+
+#include <stdio.h>
+#include <string.h>
+
+
+// 1 ms buckets up to 64 ms, then 16 ms buckets up to ~1 s. The last bucket catches everything above.
+#define LATENCY_FINE_BUCKETS (64)
+#define LATENCY_COARSE_SHIFT (4)
+#define LATENCY_BUCKET_COUNT (128)
+
+
+static uint32_t buckets[LATENCY_BUCKET_COUNT];
+static uint32_t count;
+static uint32_t max_us;
+static int64_t pending_input;
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+
+
+static int bucket_index(uint32_t us)
+{
+    uint32_t ms = us / 1000;
+
+    if (ms < LATENCY_FINE_BUCKETS) return ms;
+
+    uint32_t index = LATENCY_FINE_BUCKETS + ((ms - LATENCY_FINE_BUCKETS) >> LATENCY_COARSE_SHIFT);
+    return (index < LATENCY_BUCKET_COUNT) ? index : LATENCY_BUCKET_COUNT - 1;
+}
+
+// Upper bound of the bucket in microseconds
+static uint32_t bucket_limit(int index)
+{
+    if (index < LATENCY_FINE_BUCKETS) return (index + 1) * 1000;
+
+    return (LATENCY_FINE_BUCKETS + ((index - LATENCY_FINE_BUCKETS + 1) << LATENCY_COARSE_SHIFT)) * 1000;
+}
+
+static uint32_t percentile(const uint32_t* hist, uint32_t total, uint32_t maximum, int percent)
+{
+    if (total == 0) return 0;
+
+    uint32_t rank = (total * percent + 99) / 100;
+    uint32_t seen = 0;
+
+    for (int i = 0; i < LATENCY_BUCKET_COUNT; ++i)
+    {
+        seen += hist[i];
+        if (seen >= rank)
+        {
+            uint32_t limit = bucket_limit(i);
+            return (limit < maximum) ? limit : maximum;
+        }
+    }
+
+    return maximum;
+}
+
+
+// Called when the UI consumes a press. If several presses are handled before
+// a frame goes out, the oldest one is what the user has been waiting on.
+void odroid_latency_input(int64_t timestamp)
+{
+    portENTER_CRITICAL(&lock);
+    if (pending_input == 0) pending_input = timestamp;
+    portEXIT_CRITICAL(&lock);
+}
+
+int64_t odroid_latency_take()
+{
+    portENTER_CRITICAL(&lock);
+    int64_t result = pending_input;
+    pending_input = 0;
+    portEXIT_CRITICAL(&lock);
+
+    return result;
+}
+
+// Called from the SPI post transfer interrupt
+void odroid_latency_record(int64_t timestamp, int64_t completed)
+{
+    if (timestamp <= 0 || completed < timestamp) return;
+
+    int64_t elapsed = completed - timestamp;
+    uint32_t us = (elapsed > UINT32_MAX) ? UINT32_MAX : (uint32_t)elapsed;
+
+    portENTER_CRITICAL_ISR(&lock);
+    buckets[bucket_index(us)]++;
+    count++;
+    if (us > max_us) max_us = us;
+    portEXIT_CRITICAL_ISR(&lock);
+}
+
+void odroid_latency_get(odroid_latency_stats_t* out_stats)
+{
+    static uint32_t hist[LATENCY_BUCKET_COUNT];
+
+    portENTER_CRITICAL(&lock);
+    memcpy(hist, buckets, sizeof(hist));
+    out_stats->count = count;
+    out_stats->max_us = max_us;
+    portEXIT_CRITICAL(&lock);
+
+    out_stats->p50_us = percentile(hist, out_stats->count, out_stats->max_us, 50);
+    out_stats->p95_us = percentile(hist, out_stats->count, out_stats->max_us, 95);
+}
+
+void odroid_latency_reset()
+{
+    portENTER_CRITICAL(&lock);
+    memset(buckets, 0, sizeof(buckets));
+    count = 0;
+    max_us = 0;
+    pending_input = 0;
+    portEXIT_CRITICAL(&lock);
+}
+
+void odroid_latency_dump()
+{
+    static uint32_t hist[LATENCY_BUCKET_COUNT];
+    odroid_latency_stats_t stats;
+
+    odroid_latency_get(&stats);
+
+    portENTER_CRITICAL(&lock);
+    memcpy(hist, buckets, sizeof(hist));
+    portEXIT_CRITICAL(&lock);
+
+    printf("\n#################### input latency (%u samples) ####################\n", stats.count);
+    printf("p50=%u.%03u ms  p95=%u.%03u ms  max=%u.%03u ms\n",
+        stats.p50_us / 1000, stats.p50_us % 1000,
+        stats.p95_us / 1000, stats.p95_us % 1000,
+        stats.max_us / 1000, stats.max_us % 1000);
+
+    for (int i = 0; i < LATENCY_BUCKET_COUNT; ++i)
+    {
+        if (hist[i] == 0) continue;
+
+        uint32_t low = (i == 0) ? 0 : bucket_limit(i - 1) / 1000;
+        if (i == LATENCY_BUCKET_COUNT - 1)
+            printf("%5u+     ms: %u\n", low, hist[i]);
+        else
+            printf("%5u-%-4u ms: %u\n", low, bucket_limit(i) / 1000, hist[i]);
+    }
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct
+{
+    uint32_t count;
+    uint32_t p50_us;
+    uint32_t p95_us;
+    uint32_t max_us;
+} odroid_latency_stats_t;
+
+void odroid_latency_input(int64_t timestamp);
+int64_t odroid_latency_take();
+void odroid_latency_record(int64_t timestamp, int64_t completed);
+void odroid_latency_get(odroid_latency_stats_t* out_stats);
+void odroid_latency_reset();
+void odroid_latency_dump();
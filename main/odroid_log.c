@@ -0,0 +1,330 @@
+#include "odroid_log.h"
+
+#include "freertos/FreeRTOS.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+
+#define LOG_RECORD_COUNT (256)
+#define LOG_MAX_ARGS (8)
+#define LOG_STRING_SIZE (64)
+
+// Records keep the format pointer and the raw arguments, the text is only
+// produced when the viewer asks for it. ESP_LOG formats are literals in flash,
+// string arguments are copied since they often point to temporary buffers.
+typedef union
+{
+    int32_t i;
+    int64_t ll;
+    double d;
+    const void* p;
+} log_arg_t;
+
+typedef struct
+{
+    volatile uint32_t seq;
+    const char* format;
+    uint8_t argCount;
+    uint8_t truncated;
+    uint8_t stringsUsed;
+    uint8_t _reserved0;
+    log_arg_t args[LOG_MAX_ARGS];
+    char strings[LOG_STRING_SIZE];
+} log_record_t;
+
+typedef struct
+{
+    char conv;
+    uint8_t stars;
+    uint8_t wide; // 64-bit integer argument
+} log_spec_t;
+
+static log_record_t* records;
+static volatile uint32_t head = 0;
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+static vprintf_like_t previous_vprintf;
+
+
+
+// Parses the conversion starting after '%'. Returns false at the end of the string.
+static bool parse_spec(const char** format, log_spec_t* spec)
+{
+    const char* p = *format;
+
+    memset(spec, 0, sizeof(*spec));
+
+    while (*p && strchr("-+ #0", *p)) p++;
+
+    if (*p == '*') { spec->stars++; p++; }
+    while (*p >= '0' && *p <= '9') p++;
+
+    if (*p == '.')
+    {
+        p++;
+        if (*p == '*') { spec->stars++; p++; }
+        while (*p >= '0' && *p <= '9') p++;
+    }
+
+    // long is 32-bit here, only ll/j/q take a 64-bit argument
+    int longs = 0;
+    while (*p && strchr("hlLqjzt", *p))
+    {
+        if (*p == 'l') longs++;
+        else if (*p == 'q' || *p == 'j') longs += 2;
+        p++;
+    }
+
+    spec->wide = (longs >= 2);
+    spec->conv = *p;
+
+    if (!*p) return false;
+
+    *format = p + 1;
+    return true;
+}
+
+static int log_vprintf(const char* format, va_list args)
+{
+    va_list copy;
+    va_copy(copy, args);
+
+    uint32_t seq;
+    portENTER_CRITICAL(&lock);
+    seq = head++;
+    portEXIT_CRITICAL(&lock);
+
+    log_record_t* rec = &records[seq % LOG_RECORD_COUNT];
+    rec->seq = UINT32_MAX;
+    rec->format = format;
+    rec->argCount = 0;
+    rec->truncated = 0;
+    rec->stringsUsed = 0;
+
+    const char* p = format;
+    log_spec_t spec;
+
+    while ((p = strchr(p, '%')) != NULL)
+    {
+        p++;
+        if (*p == '%') { p++; continue; }
+        if (!parse_spec(&p, &spec)) break;
+
+        if (rec->argCount + spec.stars + 1 > LOG_MAX_ARGS)
+        {
+            rec->truncated = 1;
+            break;
+        }
+
+        for (int i = 0; i < spec.stars; ++i)
+        {
+            rec->args[rec->argCount++].i = va_arg(copy, int);
+        }
+
+        log_arg_t* arg = &rec->args[rec->argCount++];
+
+        switch (spec.conv)
+        {
+            case 'd': case 'i': case 'u': case 'o':
+            case 'x': case 'X': case 'c':
+                if (spec.wide) arg->ll = va_arg(copy, long long);
+                else arg->i = va_arg(copy, int);
+                break;
+
+            case 'f': case 'F': case 'e': case 'E':
+            case 'g': case 'G': case 'a': case 'A':
+                arg->d = va_arg(copy, double);
+                break;
+
+            case 's':
+            {
+                const char* str = va_arg(copy, const char*);
+                size_t avail = LOG_STRING_SIZE - rec->stringsUsed;
+                size_t len = str ? strnlen(str, avail - 1) : 0;
+
+                arg->i = rec->stringsUsed;
+                memcpy(rec->strings + rec->stringsUsed, str ? str : "", len);
+                rec->strings[rec->stringsUsed + len] = 0;
+                rec->stringsUsed += (avail > len + 1) ? len + 1 : len;
+                break;
+            }
+
+            default: // p, n
+                arg->p = va_arg(copy, void*);
+                break;
+        }
+    }
+
+    va_end(copy);
+
+    __asm__("memw");
+    rec->seq = seq;
+
+    return previous_vprintf ? previous_vprintf(format, args) : vprintf(format, args);
+}
+
+static size_t format_record(const log_record_t* rec, char* out, size_t size)
+{
+    const char* p = rec->format;
+    size_t len = 0;
+    int argIndex = 0;
+    char spec_text[24];
+    log_spec_t spec;
+
+    while (*p && len + 1 < size)
+    {
+        // Drop color escapes and line endings
+        if (*p == '\033')
+        {
+            while (*p && *p != 'm') p++;
+            if (*p) p++;
+            continue;
+        }
+
+        if (*p == '\n' || *p == '\r')
+        {
+            p++;
+            continue;
+        }
+
+        if (*p != '%')
+        {
+            out[len++] = *p++;
+            continue;
+        }
+
+        if (p[1] == '%')
+        {
+            out[len++] = '%';
+            p += 2;
+            continue;
+        }
+
+        const char* start = p++;
+        if (!parse_spec(&p, &spec)) break;
+
+        if (argIndex + spec.stars + 1 > rec->argCount)
+        {
+            // Ran out of captured arguments
+            strncpy(out + len, "...", size - len - 1);
+            len += strnlen(out + len, size - len - 1);
+            break;
+        }
+
+        size_t spec_len = p - start;
+        if (spec_len >= sizeof(spec_text)) break;
+        memcpy(spec_text, start, spec_len);
+        spec_text[spec_len] = 0;
+
+        int w1 = (spec.stars > 0) ? rec->args[argIndex++].i : 0;
+        int w2 = (spec.stars > 1) ? rec->args[argIndex++].i : 0;
+        const log_arg_t* arg = &rec->args[argIndex++];
+
+        char* dst = out + len;
+        size_t avail = size - len;
+        int n;
+
+#define LOG_SNPRINTF(value) \
+        (spec.stars == 0) ? snprintf(dst, avail, spec_text, value) : \
+        (spec.stars == 1) ? snprintf(dst, avail, spec_text, w1, value) : \
+                            snprintf(dst, avail, spec_text, w1, w2, value)
+
+        switch (spec.conv)
+        {
+            case 'd': case 'i': case 'u': case 'o':
+            case 'x': case 'X': case 'c':
+                if (spec.wide) n = LOG_SNPRINTF(arg->ll);
+                else n = LOG_SNPRINTF(arg->i);
+                break;
+
+            case 'f': case 'F': case 'e': case 'E':
+            case 'g': case 'G': case 'a': case 'A':
+                n = LOG_SNPRINTF(arg->d);
+                break;
+
+            case 's':
+                n = LOG_SNPRINTF(rec->strings + arg->i);
+                break;
+
+            case 'p':
+                n = LOG_SNPRINTF(arg->p);
+                break;
+
+            default:
+                n = 0;
+                break;
+        }
+
+#undef LOG_SNPRINTF
+
+        if (n < 0) break;
+        len += ((size_t)n < avail) ? (size_t)n : avail - 1;
+    }
+
+    if (rec->truncated && len + 4 < size)
+    {
+        strcpy(out + len, "...");
+        len += 3;
+    }
+
+    out[len] = 0;
+    return len;
+}
+
+
+void odroid_log_init()
+{
+    if (records) return;
+
+    records = heap_caps_malloc(LOG_RECORD_COUNT * sizeof(log_record_t), MALLOC_CAP_SPIRAM);
+    if (!records)
+    {
+        records = malloc(LOG_RECORD_COUNT * sizeof(log_record_t));
+    }
+
+    if (!records)
+    {
+        ESP_LOGE(__func__, "ring allocation failed.");
+        return;
+    }
+
+    for (int i = 0; i < LOG_RECORD_COUNT; ++i)
+    {
+        records[i].seq = UINT32_MAX;
+    }
+
+    previous_vprintf = esp_log_set_vprintf(&log_vprintf);
+
+    ESP_LOGI(__func__, "done (%d records).", LOG_RECORD_COUNT);
+}
+
+uint32_t odroid_log_head()
+{
+    return head;
+}
+
+uint32_t odroid_log_tail()
+{
+    uint32_t h = head;
+    return (h > LOG_RECORD_COUNT) ? h - LOG_RECORD_COUNT : 0;
+}
+
+bool odroid_log_format(uint32_t seq, char* out, size_t size)
+{
+    if (!records || size < 1) return false;
+
+    const log_record_t* slot = &records[seq % LOG_RECORD_COUNT];
+    log_record_t rec;
+
+    // The slot may be rewritten while we copy it, check the sequence on both sides
+    if (slot->seq != seq) return false;
+    memcpy(&rec, slot, sizeof(rec));
+    __asm__("memw");
+    if (slot->seq != seq) return false;
+
+    format_record(&rec, out, size);
+    return true;
+}
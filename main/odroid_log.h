@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+void odroid_log_init();
+uint32_t odroid_log_head();
+uint32_t odroid_log_tail();
+bool odroid_log_format(uint32_t seq, char* out, size_t size);
@@ -0,0 +1,111 @@
+#include "odroid_power.h"
+
+#include "freertos/FreeRTOS.h"
+#include "esp_pm.h"
+#include "esp32/pm.h"
+#include "esp_sleep.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+
+
+#define POWER_MAX_FREQ_MHZ (240)
+#define POWER_MIN_FREQ_MHZ (80) // keeps APB at 80 MHz, SPI and LEDC timings don't move
+#define POWER_ACTIVITY_HOLD_US (2 * 1000 * 1000)
+
+// Without CONFIG_PM_ENABLE the locks are never created and every call is a no-op.
+// The CPU then stays at CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ as before.
+static esp_pm_lock_handle_t performance_lock;
+static esp_pm_lock_handle_t awake_lock;
+static esp_pm_lock_handle_t activity_lock;
+static esp_timer_handle_t activity_timer;
+static volatile bool activity_held = false;
+static portMUX_TYPE activity_mux = portMUX_INITIALIZER_UNLOCKED;
+
+
+static void power_activity_expired(void* arg)
+{
+    portENTER_CRITICAL(&activity_mux);
+    bool release = activity_held;
+    activity_held = false;
+    portEXIT_CRITICAL(&activity_mux);
+
+    if (release) esp_pm_lock_release(activity_lock);
+}
+
+
+void odroid_power_init()
+{
+#if CONFIG_PM_ENABLE
+    esp_pm_config_esp32_t config = {
+        .max_freq_mhz = POWER_MAX_FREQ_MHZ,
+        .min_freq_mhz = POWER_MIN_FREQ_MHZ,
+        .light_sleep_enable = true
+    };
+
+    esp_err_t ret = esp_pm_configure(&config);
+    if (ret != ESP_OK)
+    {
+        ESP_LOGE(__func__, "esp_pm_configure failed (%d).", ret);
+        return;
+    }
+
+    if (esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "performance", &performance_lock) != ESP_OK ||
+        esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "awake", &awake_lock) != ESP_OK ||
+        esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "activity", &activity_lock) != ESP_OK)
+    {
+        ESP_LOGE(__func__, "esp_pm_lock_create failed.");
+        abort();
+    }
+
+    esp_timer_create_args_t args = {
+        .callback = &power_activity_expired,
+        .name = "power_activity"
+    };
+
+    if (esp_timer_create(&args, &activity_timer) != ESP_OK) abort();
+
+    // Buttons arm their GPIO wakeup in input.c
+    esp_sleep_enable_gpio_wakeup();
+
+    ESP_LOGI(__func__, "%d-%d MHz, light sleep enabled.", POWER_MIN_FREQ_MHZ, POWER_MAX_FREQ_MHZ);
+#else
+    ESP_LOGI(__func__, "power management disabled.");
+#endif
+}
+
+// Nestable, forces the maximum CPU frequency (installs, CRC checks, frame pushes)
+void odroid_power_performance_begin()
+{
+    if (performance_lock) esp_pm_lock_acquire(performance_lock);
+}
+
+void odroid_power_performance_end()
+{
+    if (performance_lock) esp_pm_lock_release(performance_lock);
+}
+
+// Nestable, for peripherals that stop in light sleep (LEDC fades)
+void odroid_power_stay_awake(bool awake)
+{
+    if (!awake_lock) return;
+
+    if (awake) esp_pm_lock_acquire(awake_lock);
+    else esp_pm_lock_release(awake_lock);
+}
+
+// Keeps light sleep off for a moment after input so the joystick is polled
+// at full rate and follow-up presses don't pay the wakeup cost
+void odroid_power_activity()
+{
+    if (!activity_lock) return;
+
+    portENTER_CRITICAL(&activity_mux);
+    bool acquire = !activity_held;
+    activity_held = true;
+    portEXIT_CRITICAL(&activity_mux);
+
+    if (acquire) esp_pm_lock_acquire(activity_lock);
+
+    esp_timer_stop(activity_timer);
+    esp_timer_start_once(activity_timer, POWER_ACTIVITY_HOLD_US);
+}
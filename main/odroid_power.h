@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stdbool.h>
+
+void odroid_power_init();
+void odroid_power_performance_begin();
+void odroid_power_performance_end();
+void odroid_power_stay_awake(bool awake);
+void odroid_power_activity();
@@ -1,5 +1,12 @@
 #include "odroid_sdcard.h"
-
+#include "odroid_spibus.h"
+#include "odroid_event.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
 //#include "esp_err.h"
 #include "esp_log.h"
 #include "esp_vfs_fat.h"
@@ -7,12 +14,15 @@
 #include "driver/sdspi_host.h"
 #include "sdmmc_cmd.h"
 #include "esp_heap_caps.h"
-#include "esp_log.h"
+#include "diskio.h"
+#include "rom/crc.h"
 
-#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <strings.h>
 
 
 
@@ -22,227 +32,773 @@
 #define SD_PIN_NUM_CS 22
 
 
+// Clock probe: a few sectors from the start of the volume are read at the
+// default clock as reference and then again at each faster step.
+#define SD_PROBE_SECTORS (16)
+#define SD_PROBE_PASSES (4)
+#define SD_SECTOR_SIZE (512)
+
+// Longest transfer before the display gets a chance at the bus, ~2.5 ms at 26 MHz
+#define SD_BUS_BURST_SECTORS (16)
+
+#define STREAM_TASK_PRIORITY (tskIDLE_PRIORITY + 5)
+
+#define SD_MAX_FILES (5)
+
+#define FILES_ARENA_INITIAL (4 * 1024)
+#define FILES_ENTRIES_INITIAL (64)
+
+
 static bool isOpen = false;
+static volatile odroid_sdcard_state_t state = ODROID_SDCARD_UNMOUNTED;
+static SemaphoreHandle_t mountLock;
+static bool isClosed = false;
+static sdmmc_host_t host;
+
+static char basePath[16];
+static char drivePath[3];
+static sdmmc_card_t* card;
+
+typedef struct
+{
+    char basePath[16];
+    nvs_handle nvs;
+    int32_t jobId;
+} sdcard_open_job_t;
+
+// Faster clocks to try, slowest first. The SD pins are routed through the GPIO
+// matrix (they are not the HSPI IOMUX pins), where the SPI master refuses full
+// duplex above 80/3 MHz. sdspi loses its device handle when that happens, so
+// 40 MHz must not be offered here.
+static const uint32_t SD_PROBE_FREQS[] = { SDMMC_FREQ_26M };
+
+
+// Card access split into bus bursts, see odroid_spibus.c
+static esp_err_t sdcard_read_sectors(void* buffer, size_t sector, size_t count)
+{
+    esp_err_t ret = ESP_OK;
+
+    while (count > 0 && ret == ESP_OK)
+    {
+        size_t burst = (count < SD_BUS_BURST_SECTORS) ? count : SD_BUS_BURST_SECTORS;
+
+        odroid_spibus_acquire(ODROID_SPIBUS_SD, ODROID_SPIBUS_PRIORITY_NORMAL);
+        ret = sdmmc_read_sectors(card, buffer, sector, burst);
+        odroid_spibus_release(ODROID_SPIBUS_SD);
+
+        buffer = (uint8_t*)buffer + burst * SD_SECTOR_SIZE;
+        sector += burst;
+        count -= burst;
+    }
+
+    return ret;
+}
+
+static esp_err_t sdcard_write_sectors(const void* buffer, size_t sector, size_t count)
+{
+    esp_err_t ret = ESP_OK;
 
+    while (count > 0 && ret == ESP_OK)
+    {
+        size_t burst = (count < SD_BUS_BURST_SECTORS) ? count : SD_BUS_BURST_SECTORS;
+
+        odroid_spibus_acquire(ODROID_SPIBUS_SD, ODROID_SPIBUS_PRIORITY_NORMAL);
+        ret = sdmmc_write_sectors(card, buffer, sector, burst);
+        odroid_spibus_release(ODROID_SPIBUS_SD);
 
+        buffer = (const uint8_t*)buffer + burst * SD_SECTOR_SIZE;
+        sector += burst;
+        count -= burst;
+    }
 
-inline static void swap(char** a, char** b)
+    return ret;
+}
+
+// FatFs disk driver, the same as the sdmmc one IDF registers at mount but
+// going through the bus arbiter
+static DSTATUS sdcard_disk_status(BYTE pdrv)
 {
-    char* t = *a;
-    *a = *b;
-    *b = t;
+    return card ? 0 : STA_NOINIT;
 }
 
-static int strcicmp(char const *a, char const *b)
+static DRESULT sdcard_disk_read(BYTE pdrv, BYTE* buff, DWORD sector, UINT count)
 {
-    for (;; a++, b++)
+    esp_err_t err = sdcard_read_sectors(buff, sector, count);
+    if (err != ESP_OK)
     {
-        int d = tolower((int)*a) - tolower((int)*b);
-        if (d != 0 || !*a) return d;
+        ESP_LOGE(__func__, "sdmmc_read_sectors failed (%d)", err);
+        return RES_ERROR;
     }
+
+    return RES_OK;
+}
+
+static DRESULT sdcard_disk_write(BYTE pdrv, const BYTE* buff, DWORD sector, UINT count)
+{
+    esp_err_t err = sdcard_write_sectors(buff, sector, count);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(__func__, "sdmmc_write_sectors failed (%d)", err);
+        return RES_ERROR;
+    }
+
+    return RES_OK;
 }
 
-static int partition (char* arr[], int low, int high)
+static DRESULT sdcard_disk_ioctl(BYTE pdrv, BYTE cmd, void* buff)
+{
+    switch (cmd)
+    {
+        case CTRL_SYNC:
+            return RES_OK;
+
+        case GET_SECTOR_COUNT:
+            *((DWORD*)buff) = card->csd.capacity;
+            return RES_OK;
+
+        case GET_SECTOR_SIZE:
+            *((WORD*)buff) = card->csd.sector_size;
+            return RES_OK;
+
+        default:
+            return RES_ERROR;
+    }
+}
+
+static const ff_diskio_impl_t sdcard_diskio = {
+    .init = &sdcard_disk_status,
+    .status = &sdcard_disk_status,
+    .read = &sdcard_disk_read,
+    .write = &sdcard_disk_write,
+    .ioctl = &sdcard_disk_ioctl,
+};
+
+
+typedef struct
+{
+    uint32_t key; // first characters folded, see files_sort_key()
+    uint32_t offset; // name offset in the arena
+    odroid_sdcard_file_info_t info;
+} files_entry_t;
+
+
+// Packs up to 4 lower-cased characters, big-endian so that integer order is
+// string order. A digit ends the key as '0': numbers are compared by value,
+// but any digit still sorts against a non-digit by character.
+static uint32_t files_sort_key(const char* name)
 {
-    char* pivot = arr[high];
-    int i = (low - 1);
+    uint32_t key = 0;
+    int i = 0;
 
-    for (int j = low; j <= high- 1; j++)
+    for (; i < 4 && name[i]; ++i)
     {
-        if (strcicmp(arr[j], pivot) < 0)
+        unsigned char c = (unsigned char)name[i];
+
+        if (isdigit(c))
         {
-            i++;
-            swap(&arr[i], &arr[j]);
+            key |= (uint32_t)'0' << (24 - i * 8);
+            break;
         }
+
+        key |= (uint32_t)tolower(c) << (24 - i * 8);
     }
-    swap(&arr[i + 1], &arr[high]);
-    return (i + 1);
+
+    return key;
 }
 
-static void quick_sort(char* arr[], int low, int high)
+// Case-insensitive, digit runs compare by numeric value ("fc2" < "fc10")
+static int files_natural_compare(const char* a, const char* b)
 {
-    if (low < high)
+    const unsigned char* pa = (const unsigned char*)a;
+    const unsigned char* pb = (const unsigned char*)b;
+
+    while (*pa && *pb)
     {
-        int pi = partition(arr, low, high);
+        if (isdigit(*pa) && isdigit(*pb))
+        {
+            while (*pa == '0') pa++;
+            while (*pb == '0') pb++;
+
+            int lengthA = 0, lengthB = 0;
+            while (isdigit(pa[lengthA])) lengthA++;
+            while (isdigit(pb[lengthB])) lengthB++;
 
-        quick_sort(arr, low, pi - 1);
-        quick_sort(arr, pi + 1, high);
+            if (lengthA != lengthB) return lengthA - lengthB;
+
+            int d = memcmp(pa, pb, lengthA);
+            if (d != 0) return d;
+
+            pa += lengthA;
+            pb += lengthB;
+            continue;
+        }
+
+        int d = tolower(*pa) - tolower(*pb);
+        if (d != 0) return d;
+
+        pa++;
+        pb++;
     }
+
+    if (*pa || *pb) return *pa ? 1 : -1;
+
+    // Only differ by case or leading zeros, keep the order stable anyway
+    return strcmp(a, b);
+}
+
+static int files_compare(const files_entry_t* a, const files_entry_t* b, const char* names)
+{
+    if (a->key != b->key) return (a->key < b->key) ? -1 : 1;
+
+    return files_natural_compare(names + a->offset, names + b->offset);
 }
 
-static void sort_files(char** files, int count)
+// Bottom-up merge sort, O(n log n) on any input and no recursion.
+// FAT directories are often already in order, runs that are already
+// merged are detected and copied as is.
+static void files_sort(files_entry_t* entries, int count, const char* names)
 {
-    int n = count;
-    bool swapped = true;
+    if (count < 2) return;
+
+    files_entry_t* temp = malloc(count * sizeof(files_entry_t));
+    if (!temp) abort();
+
+    files_entry_t* src = entries;
+    files_entry_t* dst = temp;
+
+    for (int width = 1; width < count; width *= 2)
+    {
+        for (int left = 0; left < count; left += width * 2)
+        {
+            int mid = (left + width < count) ? left + width : count;
+            int right = (left + width * 2 < count) ? left + width * 2 : count;
+
+            if (mid >= right || files_compare(&src[mid - 1], &src[mid], names) <= 0)
+            {
+                memcpy(&dst[left], &src[left], (right - left) * sizeof(files_entry_t));
+                continue;
+            }
+
+            int i = left, j = mid, k = left;
+            while (i < mid && j < right)
+            {
+                dst[k++] = (files_compare(&src[j], &src[i], names) < 0) ? src[j++] : src[i++];
+            }
+
+            while (i < mid) dst[k++] = src[i++];
+            while (j < right) dst[k++] = src[j++];
+        }
 
-    if (count > 1)
+        files_entry_t* t = src;
+        src = dst;
+        dst = t;
+    }
+
+    if (src != entries)
     {
-        quick_sort(files, 0, count - 1);
+        memcpy(entries, src, count * sizeof(files_entry_t));
     }
+
+    free(temp);
 }
 
+static bool files_has_extension(const char* name, size_t len, const char* extension, size_t extensionLength)
+{
+    return (len > extensionLength) && (strcasecmp(name + len - extensionLength, extension) == 0);
+}
 
 
-int odroid_sdcard_files_get(const char* path, const char* extension, char*** filesOut)
+// Maps a path under the mount point to the FatFs volume, "/sd/x" -> "0:/x"
+static bool files_fatfs_path(const char* path, char* out, size_t size)
+{
+    size_t baseLength = strlen(basePath);
+
+    if (!isOpen || strncmp(path, basePath, baseLength) != 0) return false;
+
+    return snprintf(out, size, "%s%s", drivePath, path + baseLength) < size;
+}
+
+// Returns the sorted names in a single allocation: the pointer array, the
+// optional info array, then the strings. Release it with odroid_sdcard_files_free().
+// No matching file leaves *filesOut NULL.
+// The directory is read with FatFs directly, which hands out the size and
+// date of each entry in the same pass (stat() would search the directory again).
+int odroid_sdcard_files_get_info(const char* path, const char* extension, char*** filesOut, odroid_sdcard_file_info_t** infoOut)
 {
-    const int MAX_FILES = 1024;
-    const uint32_t MALLOC_CAPS = MALLOC_CAP_DEFAULT; //MALLOC_CAP_SPIRAM
+    *filesOut = NULL;
+    if (infoOut) *infoOut = NULL;
+
+    size_t extensionLength = strlen(extension);
+    if (extensionLength < 1) abort();
+
+    char fatfsPath[256];
+    if (!files_fatfs_path(path, fatfsPath, sizeof(fatfsPath)))
+    {
+        ESP_LOGE(__func__, "not on the card: %s", path);
+        return 0;
+    }
 
+    FF_DIR* dir = malloc(sizeof(FF_DIR));
+    FILINFO* fileInfo = malloc(sizeof(FILINFO));
+    if (!dir || !fileInfo) abort();
 
+    FRESULT res = f_opendir(dir, fatfsPath);
+    if (res != FR_OK)
+    {
+        ESP_LOGE(__func__, "opendir failed (%d).", res);
+        free(fileInfo);
+        free(dir);
+        return 0;
+    }
+
+    // Names are appended to one growing arena, entries refer to them by offset
+    // so the arena can move when it grows.
+    size_t arenaSize = FILES_ARENA_INITIAL;
+    size_t arenaUsed = 0;
+    char* arena = malloc(arenaSize);
+
+    int entriesMax = FILES_ENTRIES_INITIAL;
     int count = 0;
-    char** result = (char**)malloc(MAX_FILES * sizeof(void*));
-    if (!result) abort();
+    files_entry_t* entries = malloc(entriesMax * sizeof(files_entry_t));
 
+    if (!arena || !entries) abort();
 
-    DIR *dir = opendir(path);
-    if( dir == NULL )
+    while (f_readdir(dir, fileInfo) == FR_OK && fileInfo->fname[0])
     {
-        ESP_LOGE(__func__, "opendir failed.");
+        const char* name = fileInfo->fname;
+
+        // ignore 'hidden' files (MAC) and folders
+        if (name[0] == '.' || (fileInfo->fattrib & AM_DIR)) continue;
+
+        size_t len = strlen(name);
+        if (!files_has_extension(name, len, extension, extensionLength)) continue;
+
+        if (arenaUsed + len + 1 > arenaSize)
+        {
+            while (arenaUsed + len + 1 > arenaSize) arenaSize *= 2;
+
+            arena = realloc(arena, arenaSize);
+            if (!arena) abort();
+        }
+
+        if (count >= entriesMax)
+        {
+            entriesMax *= 2;
+
+            entries = realloc(entries, entriesMax * sizeof(files_entry_t));
+            if (!entries) abort();
+        }
+
+        memcpy(arena + arenaUsed, name, len + 1);
+
+        entries[count].key = files_sort_key(name);
+        entries[count].offset = arenaUsed;
+        entries[count].info.size = fileInfo->fsize;
+        entries[count].info.mtime = ((uint32_t)fileInfo->fdate << 16) | fileInfo->ftime;
+        count++;
+
+        arenaUsed += len + 1;
+    }
+
+    f_closedir(dir);
+    free(fileInfo);
+    free(dir);
+
+    // Nothing to lay out, and malloc(0) may well return NULL
+    if (count == 0)
+    {
+        free(entries);
+        free(arena);
+
         return 0;
     }
 
-    int extensionLength = strlen(extension);
-    if (extensionLength < 1) abort();
+    files_sort(entries, count, arena);
 
+    // Lay the names out in sorted order behind the pointer and info arrays
+    size_t infoSize = infoOut ? count * sizeof(odroid_sdcard_file_info_t) : 0;
 
-    char* temp = (char*)malloc(extensionLength + 1);
-    if (!temp) abort();
+    char** result = malloc(count * sizeof(char*) + infoSize + arenaUsed);
+    if (!result) abort();
+
+    odroid_sdcard_file_info_t* info = (odroid_sdcard_file_info_t*)(result + count);
+    char* names = (char*)(result + count) + infoSize;
+
+    for (int i = 0; i < count; ++i)
+    {
+        const char* name = arena + entries[i].offset;
+        size_t size = strlen(name) + 1;
+
+        memcpy(names, name, size);
+        result[i] = names;
+        names += size;
+
+        if (infoOut) info[i] = entries[i].info;
+    }
+
+    free(entries);
+    free(arena);
+
+    ESP_LOGD(__func__, "%d files, %d bytes of names", count, arenaUsed);
+
+    *filesOut = result;
+    if (infoOut) *infoOut = info;
+
+    return count;
+}
+
+// Size and date in the same form as odroid_sdcard_files_get_info()
+bool odroid_sdcard_get_info(const char* path, odroid_sdcard_file_info_t* out_info)
+{
+    char fatfsPath[256];
+    if (!files_fatfs_path(path, fatfsPath, sizeof(fatfsPath))) return false;
+
+    FILINFO* fileInfo = malloc(sizeof(FILINFO));
+    if (!fileInfo) abort();
+
+    FRESULT res = f_stat(fatfsPath, fileInfo);
+    if (res == FR_OK)
+    {
+        out_info->size = fileInfo->fsize;
+        out_info->mtime = ((uint32_t)fileInfo->fdate << 16) | fileInfo->ftime;
+    }
+
+    free(fileInfo);
+    return res == FR_OK;
+}
+
+int odroid_sdcard_files_get(const char* path, const char* extension, char*** filesOut)
+{
+    return odroid_sdcard_files_get_info(path, extension, filesOut, NULL);
+}
 
-    memset(temp, 0, extensionLength + 1);
+void odroid_sdcard_files_free(char** files, int count)
+{
+    // Names live in the same block as the pointers
+    free(files);
+}
 
+static esp_err_t sdcard_read_crc(uint8_t* buffer, size_t start, uint32_t* out_crc)
+{
+    esp_err_t ret = sdmmc_read_sectors(card, buffer, start, SD_PROBE_SECTORS);
+    if (ret == ESP_OK)
+    {
+        *out_crc = crc32_le(0, buffer, SD_PROBE_SECTORS * SD_SECTOR_SIZE);
+    }
+
+    return ret;
+}
 
-    struct dirent *entry;
-    while((entry=readdir(dir)) != NULL)
+static esp_err_t sdcard_set_clock(uint32_t freq_khz)
+{
+    esp_err_t ret = card->host.set_card_clk(card->host.slot, freq_khz);
+    if (ret != ESP_OK)
     {
-        size_t len = strlen(entry->d_name);
+        ESP_LOGE(__func__, "set_card_clk(%d) failed (%d)", freq_khz, ret);
+    }
+
+    return ret;
+}
 
+// Steps the clock up while the probe region reads back without CRC or timeout
+// errors and matches the reference. Returns the fastest clock that passed,
+// the card is left running at it.
+static uint32_t sdcard_probe_clock(uint8_t* buffer)
+{
+    uint32_t best = SDMMC_FREQ_DEFAULT;
+    uint32_t reference;
+    uint32_t crc;
+
+    // Start of the first partition, the MBR alone is mostly zeros
+    size_t start = 0;
+    if (sdmmc_read_sectors(card, buffer, 0, 1) != ESP_OK) return best;
+    if (buffer[510] == 0x55 && buffer[511] == 0xaa && buffer[0] != 0xeb && buffer[0] != 0xe9)
+    {
+        start = buffer[454] | (buffer[455] << 8) | (buffer[456] << 16) | (buffer[457] << 24);
+        if (start + SD_PROBE_SECTORS > card->csd.capacity) start = 0;
+    }
 
-        // ignore 'hidden' files (MAC)
-        bool skip = false;
-        if (entry->d_name[0] == '.') skip = true;
+    if (sdcard_read_crc(buffer, start, &reference) != ESP_OK) return best;
 
+    for (int i = 0; i < sizeof(SD_PROBE_FREQS) / sizeof(SD_PROBE_FREQS[0]); ++i)
+    {
+        uint32_t freq = SD_PROBE_FREQS[i];
+        if (sdcard_set_clock(freq) != ESP_OK) break;
 
-        memset(temp, 0, extensionLength + 1);
-        if (!skip)
+        bool passed = true;
+        for (int pass = 0; pass < SD_PROBE_PASSES && passed; ++pass)
         {
-            for (int i = 0; i < extensionLength; ++i)
+            esp_err_t err = sdcard_read_crc(buffer, start, &crc);
+            if (err != ESP_OK)
             {
-                temp[i] = tolower((int)entry->d_name[len - extensionLength + i]);
+                ESP_LOGW(__func__, "%d kHz: read failed (%d)", freq, err);
+                passed = false;
             }
-
-            if (len > extensionLength)
+            else if (crc != reference)
             {
-                if (strcmp(temp, extension) == 0)
-                {
-                    result[count] = (char*)malloc(len + 1);
+                ESP_LOGW(__func__, "%d kHz: data mismatch", freq);
+                passed = false;
+            }
+        }
 
-                    if (!result[count])
-                    {
-                        abort();
-                    }
+        if (!passed) break;
+        best = freq;
+    }
 
-                    strcpy(result[count], entry->d_name);
-                    ++count;
+    // A failed step can leave the card mid-transfer, settle it with one read
+    sdcard_set_clock(best);
+    if (sdcard_read_crc(buffer, start, &crc) != ESP_OK || crc != reference)
+    {
+        best = SDMMC_FREQ_DEFAULT;
+        sdcard_set_clock(best);
+    }
 
-                    if (count >= MAX_FILES) break;
-                }
-            }
+    return best;
+}
+
+// Runs the card at the cached clock for its CID, probing on first sight.
+// The card is mounted at SDMMC_FREQ_DEFAULT so this only ever speeds it up.
+static void sdcard_select_clock(nvs_handle nvs)
+{
+    char key[16];
+    uint32_t freq = 0;
+
+    sprintf(key, "sdclk%08x", crc32_le(0, (const uint8_t*)&card->cid, sizeof(card->cid)));
+
+    uint8_t* buffer = heap_caps_malloc(SD_PROBE_SECTORS * SD_SECTOR_SIZE, MALLOC_CAP_DMA);
+    if (!buffer) abort();
+
+    if (nvs_get_u32(nvs, key, &freq) == ESP_OK && freq > SDMMC_FREQ_DEFAULT)
+    {
+        // A single clean read is enough to trust the cached result
+        if (sdcard_set_clock(freq) != ESP_OK ||
+            sdmmc_read_sectors(card, buffer, 0, SD_PROBE_SECTORS) != ESP_OK)
+        {
+            ESP_LOGW(__func__, "cached %d kHz failed, probing again.", freq);
+            sdcard_set_clock(SDMMC_FREQ_DEFAULT);
+            freq = 0;
         }
     }
 
-    closedir(dir);
-    free(temp);
+    if (freq == 0)
+    {
+        freq = sdcard_probe_clock(buffer);
 
-    sort_files(result, count);
+        nvs_set_u32(nvs, key, freq);
+        nvs_commit(nvs);
+    }
 
-    *filesOut = result;
-    return count;
+    free(buffer);
+
+    ESP_LOGI(__func__, "card %s: %d kHz", card->cid.name, freq);
 }
 
-void odroid_sdcard_files_free(char** files, int count)
+// Claims the bus pins and the SPI host. No card traffic, the card itself is
+// only brought up by the first odroid_sdcard_open().
+esp_err_t odroid_sdcard_init()
 {
-    for (int i = 0; i < count; ++i)
+    sdmmc_host_t defaultHost = SDSPI_HOST_DEFAULT();
+    host = defaultHost;
+    host.slot = HSPI_HOST;
+
+    // Mount at the safe clock, sdcard_select_clock() raises it afterwards
+    host.max_freq_khz = SDMMC_FREQ_DEFAULT;
+
+    sdspi_slot_config_t slot_config = SDSPI_SLOT_CONFIG_DEFAULT();
+    slot_config.gpio_miso = (gpio_num_t)SD_PIN_NUM_MISO;
+    slot_config.gpio_mosi = (gpio_num_t)SD_PIN_NUM_MOSI;
+    slot_config.gpio_sck  = (gpio_num_t)SD_PIN_NUM_CLK;
+    slot_config.gpio_cs = (gpio_num_t)SD_PIN_NUM_CS;
+
+    mountLock = xSemaphoreCreateMutex();
+    if (!mountLock) abort();
+
+    esp_err_t ret = host.init();
+    if (ret == ESP_OK)
     {
-        free(files[i]);
+        ret = sdspi_host_init_slot(host.slot, &slot_config);
     }
 
-    free(files);
+    if (ret != ESP_OK)
+    {
+        ESP_LOGE(__func__, "sdspi init failed (%d)", ret);
+        state = ODROID_SDCARD_FAILED;
+    }
+
+    return ret;
 }
 
-esp_err_t odroid_sdcard_open(const char* base_path)
+// The steps of esp_vfs_fat_sdmmc_mount() minus the host setup, which
+// odroid_sdcard_init() did at boot
+static esp_err_t sdcard_mount(const char* base_path, nvs_handle nvs)
 {
-    esp_err_t ret;
+    BYTE pdrv = 0xff;
+    if (ff_diskio_get_drive(&pdrv) != ESP_OK || pdrv == 0xff)
+    {
+        return ESP_ERR_NO_MEM;
+    }
 
-    if (isOpen)
+    card = malloc(sizeof(sdmmc_card_t));
+    if (!card) abort();
+
+    // Card init and the clock probe talk to the card directly, hold the bus
+    // for all of it
+    odroid_spibus_acquire(ODROID_SPIBUS_SD, ODROID_SPIBUS_PRIORITY_NORMAL);
+
+    esp_err_t ret = sdmmc_card_init(&host, card);
+    if (ret == ESP_OK)
     {
-        ESP_LOGE(__func__, "already open.");
-        ret = ESP_FAIL;
+        sdcard_select_clock(nvs);
     }
-    else
+
+    odroid_spibus_release(ODROID_SPIBUS_SD);
+
+    if (ret != ESP_OK)
+    {
+        ESP_LOGE(__func__, "sdmmc_card_init failed (%d)", ret);
+        goto sdcard_mount_fail;
+    }
+
+    // From here on FatFs reaches the card through the arbiter
+    ff_diskio_register(pdrv, &sdcard_diskio);
+
+    drivePath[0] = '0' + pdrv;
+    drivePath[1] = ':';
+    drivePath[2] = 0;
+
+    FATFS* fs = NULL;
+    ret = esp_vfs_fat_register(base_path, drivePath, SD_MAX_FILES, &fs);
+    if (ret != ESP_OK && ret != ESP_ERR_INVALID_STATE)
+    {
+        ESP_LOGE(__func__, "esp_vfs_fat_register failed (%d)", ret);
+        ff_diskio_register(pdrv, NULL);
+        goto sdcard_mount_fail;
+    }
+
+    FRESULT res = f_mount(fs, drivePath, 1);
+    if (res != FR_OK)
     {
-        sdmmc_host_t host = SDSPI_HOST_DEFAULT();
-    	host.slot = HSPI_HOST; // HSPI_HOST;
-    	//host.max_freq_khz = SDMMC_FREQ_HIGHSPEED; //10000000;
-        host.max_freq_khz = SDMMC_FREQ_DEFAULT;
+        ESP_LOGE(__func__, "f_mount failed (%d)", res);
+        esp_vfs_fat_unregister_path(base_path);
+        ff_diskio_register(pdrv, NULL);
+        ret = ESP_FAIL;
+        goto sdcard_mount_fail;
+    }
 
-    	sdspi_slot_config_t slot_config = SDSPI_SLOT_CONFIG_DEFAULT();
-    	slot_config.gpio_miso = (gpio_num_t)SD_PIN_NUM_MISO;
-    	slot_config.gpio_mosi = (gpio_num_t)SD_PIN_NUM_MOSI;
-    	slot_config.gpio_sck  = (gpio_num_t)SD_PIN_NUM_CLK;
-    	slot_config.gpio_cs = (gpio_num_t)SD_PIN_NUM_CS;
-    	//slot_config.dma_channel = 2;
+    strncpy(basePath, base_path, sizeof(basePath) - 1);
+    return ESP_OK;
 
-    	// Options for mounting the filesystem.
-    	// If format_if_mount_failed is set to true, SD card will be partitioned and
-    	// formatted in case when mounting fails.
-    	esp_vfs_fat_sdmmc_mount_config_t mount_config;
-        memset(&mount_config, 0, sizeof(mount_config));
+sdcard_mount_fail:
+    free(card);
+    card = NULL;
+    return ret;
+}
 
-    	mount_config.format_if_mount_failed = false;
-    	mount_config.max_files = 5;
+// Mounts the card on first use. Later calls return at once while it stays
+// mounted, a failed mount is tried again (the card may have been inserted).
+esp_err_t odroid_sdcard_open(const char* base_path, nvs_handle nvs)
+{
+    esp_err_t ret = ESP_OK;
 
+    if (!mountLock)
+    {
+        ESP_LOGE(__func__, "not initialized.");
+        return ESP_ERR_INVALID_STATE;
+    }
 
-    	// Use settings defined above to initialize SD card and mount FAT filesystem.
-    	// Note: esp_vfs_fat_sdmmc_mount is an all-in-one convenience function.
-    	// Please check its source code and implement error recovery when developing
-    	// production applications.
-    	sdmmc_card_t* card;
-    	ret = esp_vfs_fat_sdmmc_mount(base_path, &host, &slot_config, &mount_config, &card);
+    xSemaphoreTake(mountLock, portMAX_DELAY);
 
-    	if (ret == ESP_OK || ret == ESP_ERR_INVALID_STATE)
+    if (isClosed)
+    {
+        // A background mount that lost the race with odroid_sdcard_close()
+        ret = ESP_ERR_INVALID_STATE;
+    }
+    else if (!isOpen)
+    {
+        int64_t start = esp_timer_get_time();
+        state = ODROID_SDCARD_MOUNTING;
+
+        ret = sdcard_mount(base_path, nvs);
+        if (ret == ESP_OK)
         {
-            ret = ESP_OK;
             isOpen = true;
+            state = ODROID_SDCARD_MOUNTED;
+            ESP_LOGI(__func__, "mounted in %d ms.", (int)((esp_timer_get_time() - start) / 1000));
         }
         else
         {
-            ESP_LOGE(__func__, "esp_vfs_fat_sdmmc_mount failed (%d)", ret);
+            state = ODROID_SDCARD_FAILED;
         }
     }
 
+    xSemaphoreGive(mountLock);
+
 	return ret;
 }
 
+static void sdcard_open_task(void* arg)
+{
+    sdcard_open_job_t* job = (sdcard_open_job_t*)arg;
+
+    esp_err_t ret = odroid_sdcard_open(job->basePath, job->nvs);
+    odroid_event_post_data(ODROID_EVENT_JOB, job->jobId, ret);
 
+    free(job);
+    vTaskDelete(NULL);
+}
+
+// Mounts in the background and posts the result as a job event
+void odroid_sdcard_open_async(const char* base_path, nvs_handle nvs, int32_t job_id)
+{
+    sdcard_open_job_t* job = calloc(1, sizeof(sdcard_open_job_t));
+    if (!job) abort();
+
+    strncpy(job->basePath, base_path, sizeof(job->basePath) - 1);
+    job->nvs = nvs;
+    job->jobId = job_id;
+
+    if (!isOpen) state = ODROID_SDCARD_MOUNTING;
+    xTaskCreatePinnedToCore(&sdcard_open_task, "sdmount", 1024 * 3, job, tskIDLE_PRIORITY + 1, NULL, 1);
+}
+
+odroid_sdcard_state_t odroid_sdcard_get_state()
+{
+    return state;
+}
+
+// Callers stop their own card users first (the firmware indexer). A mount in
+// progress is waited for, and none can start afterwards.
 esp_err_t odroid_sdcard_close()
 {
-    esp_err_t ret;
+    esp_err_t ret = ESP_OK;
 
-    if (!isOpen)
+    if (!mountLock) return ret;
+
+    xSemaphoreTake(mountLock, portMAX_DELAY);
+
+    // Never mounted is fine, the session may not have needed the card
+    if (isOpen)
     {
-        ESP_LOGE(__func__, "not open.");
-        ret = ESP_FAIL;
+        f_mount(NULL, drivePath, 0);
+        esp_vfs_fat_unregister_path(basePath);
+        ff_diskio_register(drivePath[0] - '0', NULL);
+
+        free(card);
+        card = NULL;
+        isOpen = false;
+        state = ODROID_SDCARD_UNMOUNTED;
     }
-    else
-    {
-        ret = esp_vfs_fat_sdmmc_unmount();
 
-        if (ret != ESP_OK)
-        {
-            ESP_LOGE(__func__, "esp_vfs_fat_sdmmc_unmount failed (%d)", ret);
-    	}
+    ret = host.deinit();
+    if (ret != ESP_OK)
+    {
+        ESP_LOGE(__func__, "sdspi deinit failed (%d)", ret);
     }
 
+    isClosed = true;
+
+    xSemaphoreGive(mountLock);
+
     return ret;
 }
 
@@ -290,28 +846,393 @@ size_t odroid_sdcard_copy_file_to_memory(const char* path, void* ptr)
         }
         else
         {
-            FILE* f = fopen(path, "rb");
-            if (f == NULL)
+            odroid_sdcard_stream_t* stream = odroid_sdcard_stream_open(path, 0, 0, 2, 16 * 1024);
+            if (stream == NULL)
             {
-                ESP_LOGE(__func__, "fopen failed.");
+                ESP_LOGE(__func__, "stream open failed.");
             }
             else
             {
-                // copy
-                const size_t BLOCK_SIZE = 512;
-                while(true)
+                const uint8_t* data;
+                int count;
+
+                while ((count = odroid_sdcard_stream_acquire(stream, &data)) > 0)
                 {
-                    __asm__("memw");
-                    size_t count = fread((uint8_t*)ptr + ret, 1, BLOCK_SIZE, f);
-                    __asm__("memw");
+                    memcpy((uint8_t*)ptr + ret, data, count);
+                    odroid_sdcard_stream_release(stream);
 
                     ret += count;
-
-                    if (count < BLOCK_SIZE) break;
                 }
+
+                odroid_sdcard_stream_close(stream);
             }
         }
     }
 
     return ret;
 }
+
+
+// Streaming reader. A task reads the file into a ring of DMA capable buffers
+// while the consumer works on the ones already filled. Buffers go back to the
+// reader in the order they were handed out, so the ring is walked in order
+// on both sides.
+typedef struct
+{
+    int index;
+    int count; // 0 at the end, -1 on a read error
+} stream_block_t;
+
+// A run of consecutive clusters of the file on the card
+typedef struct
+{
+    DWORD sector;
+    DWORD sectors;
+    size_t offset; // file offset of the first byte
+} stream_extent_t;
+
+struct odroid_sdcard_stream
+{
+    FIL file;
+    size_t position;
+    size_t remaining;
+
+    // Cluster chain resolved at open, empty if it couldn't be
+    stream_extent_t* extents;
+    int extentCount;
+    int extentIndex;
+
+    int bufferCount;
+    size_t bufferSize;
+    uint8_t** buffers;
+
+    QueueHandle_t freeQueue; // buffer index, consumer -> reader
+    QueueHandle_t fullQueue; // stream_block_t, reader -> consumer
+
+    volatile bool cancel;
+    volatile bool done;
+
+    // Consumer side
+    int acquired;
+    int nextRelease;
+    int result; // set once the end or an error was seen
+    bool ended;
+
+    const uint8_t* cursor;
+    size_t cursorLeft;
+    bool cursorHeld;
+};
+
+
+// Resolves the file's cluster chain into runs of consecutive sectors, read
+// straight from the FAT. Takes the volume lock, FatFs may be using the card
+// from another task.
+static void sdcard_stream_map(odroid_sdcard_stream_t* stream)
+{
+    FATFS* fs = stream->file.obj.fs;
+    size_t size = f_size(&stream->file);
+
+    if (fs->fs_type != FS_FAT16 && fs->fs_type != FS_FAT32) return;
+#if FF_MAX_SS != FF_MIN_SS
+    if (fs->ssize != SD_SECTOR_SIZE) return;
+#endif
+
+    size_t clusterSize = fs->csize * SD_SECTOR_SIZE;
+    DWORD entrySize = (fs->fs_type == FS_FAT32) ? 4 : 2;
+    DWORD cluster = stream->file.obj.sclust;
+    DWORD fatSector = 0;
+    int capacity = 0;
+    bool ok = true;
+
+    uint8_t* fat = heap_caps_malloc(SD_SECTOR_SIZE, MALLOC_CAP_DMA);
+    if (!fat) abort();
+
+    ff_req_grant(fs->sobj);
+
+    for (size_t offset = 0; offset < size; offset += clusterSize)
+    {
+        if (cluster < 2 || cluster >= fs->n_fatent)
+        {
+            ok = false;
+            break;
+        }
+
+        DWORD sector = fs->database + (cluster - 2) * fs->csize;
+        stream_extent_t* last = stream->extentCount ? &stream->extents[stream->extentCount - 1] : NULL;
+
+        if (last && last->sector + last->sectors == sector)
+        {
+            last->sectors += fs->csize;
+        }
+        else
+        {
+            if (stream->extentCount == capacity)
+            {
+                capacity = capacity ? capacity * 2 : 16;
+                stream->extents = realloc(stream->extents, capacity * sizeof(stream_extent_t));
+                if (!stream->extents) abort();
+            }
+
+            stream_extent_t* extent = &stream->extents[stream->extentCount++];
+            extent->sector = sector;
+            extent->sectors = fs->csize;
+            extent->offset = offset;
+        }
+
+        if (offset + clusterSize >= size) break;
+
+        DWORD want = fs->fatbase + cluster * entrySize / SD_SECTOR_SIZE;
+        if (want != fatSector)
+        {
+            if (sdcard_read_sectors(fat, want, 1) != ESP_OK)
+            {
+                ok = false;
+                break;
+            }
+            fatSector = want;
+        }
+
+        const uint8_t* entry = fat + (cluster * entrySize) % SD_SECTOR_SIZE;
+        cluster = (entrySize == 4) ?
+            (entry[0] | (entry[1] << 8) | (entry[2] << 16) | (entry[3] << 24)) & 0x0fffffff :
+            (entry[0] | (entry[1] << 8));
+    }
+
+    ff_rel_grant(fs->sobj);
+    free(fat);
+
+    if (!ok)
+    {
+        ESP_LOGW(__func__, "broken cluster chain, using FatFs reads.");
+        free(stream->extents);
+        stream->extents = NULL;
+        stream->extentCount = 0;
+    }
+}
+
+// Fills one buffer from the current position and returns the byte count, 0
+// at the end or -1 on error. Whole sectors inside a contiguous run are read
+// from the card in one multi-block transfer, the unaligned head and the tail
+// go through FatFs.
+static int sdcard_stream_fill(odroid_sdcard_stream_t* stream, uint8_t* buffer)
+{
+    size_t length = (stream->remaining < stream->bufferSize) ? stream->remaining : stream->bufferSize;
+    if (length == 0) return 0;
+
+    while (stream->extentIndex < stream->extentCount)
+    {
+        const stream_extent_t* extent = &stream->extents[stream->extentIndex];
+        if (stream->position < extent->offset + extent->sectors * SD_SECTOR_SIZE) break;
+        stream->extentIndex++;
+    }
+
+    if (stream->extentIndex < stream->extentCount)
+    {
+        const stream_extent_t* extent = &stream->extents[stream->extentIndex];
+        size_t sectorOffset = stream->position % SD_SECTOR_SIZE;
+
+        if (sectorOffset == 0 && length >= SD_SECTOR_SIZE)
+        {
+            DWORD first = (stream->position - extent->offset) / SD_SECTOR_SIZE;
+            DWORD sectors = length / SD_SECTOR_SIZE;
+            if (sectors > extent->sectors - first) sectors = extent->sectors - first;
+
+            FATFS* fs = stream->file.obj.fs;
+            ff_req_grant(fs->sobj);
+            esp_err_t err = sdcard_read_sectors(buffer, extent->sector + first, sectors);
+            ff_rel_grant(fs->sobj);
+
+            if (err != ESP_OK)
+            {
+                ESP_LOGE(__func__, "sdmmc_read_sectors failed (%d).", err);
+                return -1;
+            }
+
+            length = sectors * SD_SECTOR_SIZE;
+            stream->position += length;
+            stream->remaining -= length;
+            return length;
+        }
+
+        // Up to the next sector boundary, the fast path takes over from there
+        if (sectorOffset && length > SD_SECTOR_SIZE - sectorOffset)
+        {
+            length = SD_SECTOR_SIZE - sectorOffset;
+        }
+    }
+
+    UINT count = 0;
+    if (f_lseek(&stream->file, stream->position) != FR_OK ||
+        f_read(&stream->file, buffer, length, &count) != FR_OK || count != length)
+    {
+        ESP_LOGE(__func__, "f_read failed (%d of %d bytes).", count, length);
+        return -1;
+    }
+
+    stream->position += length;
+    stream->remaining -= length;
+    return length;
+}
+
+static void sdcard_stream_task(void* arg)
+{
+    odroid_sdcard_stream_t* stream = (odroid_sdcard_stream_t*)arg;
+    stream_block_t block;
+
+    while (!stream->cancel)
+    {
+        if (xQueueReceive(stream->freeQueue, &block.index, portMAX_DELAY) != pdTRUE) continue;
+        if (stream->cancel) break;
+
+        block.count = sdcard_stream_fill(stream, stream->buffers[block.index]);
+
+        xQueueSend(stream->fullQueue, &block, portMAX_DELAY);
+
+        if (block.count <= 0) break;
+    }
+
+    stream->done = true;
+    vTaskDelete(NULL);
+}
+
+// Streams length bytes from offset, or up to the end of the file when length
+// is 0. Returns NULL if the file can't be opened.
+odroid_sdcard_stream_t* odroid_sdcard_stream_open(const char* path, size_t offset, size_t length, int bufferCount, size_t bufferSize)
+{
+    if (bufferCount < 1 || bufferSize < 1) abort();
+
+    char fatfsPath[256];
+    if (!files_fatfs_path(path, fatfsPath, sizeof(fatfsPath)))
+    {
+        ESP_LOGE(__func__, "not on the card: %s", path);
+        return NULL;
+    }
+
+    odroid_sdcard_stream_t* stream = calloc(1, sizeof(odroid_sdcard_stream_t));
+    if (!stream) abort();
+
+    if (f_open(&stream->file, fatfsPath, FA_READ) != FR_OK)
+    {
+        ESP_LOGE(__func__, "f_open failed: %s", path);
+        free(stream);
+        return NULL;
+    }
+
+    size_t size = f_size(&stream->file);
+    if (offset > size) offset = size;
+    if (length == 0 || length > size - offset) length = size - offset;
+
+    stream->position = offset;
+    stream->remaining = length;
+    stream->bufferCount = bufferCount;
+    stream->bufferSize = bufferSize;
+
+    sdcard_stream_map(stream);
+
+    stream->buffers = calloc(bufferCount, sizeof(uint8_t*));
+    if (!stream->buffers) abort();
+
+    stream->freeQueue = xQueueCreate(bufferCount, sizeof(int));
+    stream->fullQueue = xQueueCreate(bufferCount, sizeof(stream_block_t));
+    if (!stream->freeQueue || !stream->fullQueue) abort();
+
+    for (int i = 0; i < bufferCount; ++i)
+    {
+        stream->buffers[i] = heap_caps_malloc(bufferSize, MALLOC_CAP_DMA);
+        if (!stream->buffers[i]) abort();
+
+        xQueueSend(stream->freeQueue, &i, 0);
+    }
+
+    xTaskCreatePinnedToCore(&sdcard_stream_task, "sdstream", 1024 * 3, stream, STREAM_TASK_PRIORITY, NULL, 1);
+
+    return stream;
+}
+
+// Waits for the next filled buffer and returns its byte count, 0 at the end
+// of the stream or -1 on a read error. The data stays valid until the buffer
+// is handed back with odroid_sdcard_stream_release().
+int odroid_sdcard_stream_acquire(odroid_sdcard_stream_t* stream, const uint8_t** out_data)
+{
+    if (stream->ended) return stream->result;
+
+    stream_block_t block;
+    xQueueReceive(stream->fullQueue, &block, portMAX_DELAY);
+
+    if (block.count <= 0)
+    {
+        stream->ended = true;
+        stream->result = block.count;
+        return block.count;
+    }
+
+    stream->acquired++;
+    *out_data = stream->buffers[block.index];
+
+    return block.count;
+}
+
+// Hands the oldest acquired buffer back to the reader.
+void odroid_sdcard_stream_release(odroid_sdcard_stream_t* stream)
+{
+    if (stream->acquired < 1) abort();
+
+    int index = stream->nextRelease;
+    stream->nextRelease = (stream->nextRelease + 1) % stream->bufferCount;
+    stream->acquired--;
+
+    xQueueSend(stream->freeQueue, &index, portMAX_DELAY);
+}
+
+// Byte oriented access on top of acquire/release, for consumers that work in
+// units other than the buffer size. Returns up to max bytes from the current
+// buffer without copying, valid until the next call. Don't mix with acquire.
+int odroid_sdcard_stream_read(odroid_sdcard_stream_t* stream, size_t max, const uint8_t** out_data)
+{
+    if (stream->cursorLeft == 0)
+    {
+        if (stream->cursorHeld)
+        {
+            odroid_sdcard_stream_release(stream);
+            stream->cursorHeld = false;
+        }
+
+        int count = odroid_sdcard_stream_acquire(stream, &stream->cursor);
+        if (count <= 0) return count;
+
+        stream->cursorHeld = true;
+        stream->cursorLeft = count;
+    }
+
+    size_t count = (max < stream->cursorLeft) ? max : stream->cursorLeft;
+
+    *out_data = stream->cursor;
+    stream->cursor += count;
+    stream->cursorLeft -= count;
+
+    return count;
+}
+
+void odroid_sdcard_stream_close(odroid_sdcard_stream_t* stream)
+{
+    if (!stream) return;
+
+    // The reader is either waiting for a free buffer or about to look at the
+    // flag, wake it in case it waits
+    stream->cancel = true;
+    int wake = 0;
+    xQueueSend(stream->freeQueue, &wake, 0);
+    while (!stream->done) vTaskDelay(1);
+
+    for (int i = 0; i < stream->bufferCount; ++i)
+    {
+        free(stream->buffers[i]);
+    }
+
+    vQueueDelete(stream->freeQueue);
+    vQueueDelete(stream->fullQueue);
+    f_close(&stream->file);
+    free(stream->extents);
+    free(stream->buffers);
+    free(stream);
+}
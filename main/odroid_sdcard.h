@@ -1,10 +1,42 @@
 #pragma once
 
 #include "esp_err.h"
+#include "nvs.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct
+{
+    uint32_t size;
+    uint32_t mtime; // FAT date << 16 | FAT time
+} odroid_sdcard_file_info_t;
+
+typedef struct odroid_sdcard_stream odroid_sdcard_stream_t;
+
+typedef enum
+{
+    ODROID_SDCARD_UNMOUNTED = 0,
+    ODROID_SDCARD_MOUNTING,
+    ODROID_SDCARD_MOUNTED,
+    ODROID_SDCARD_FAILED,
+} odroid_sdcard_state_t;
 
 int odroid_sdcard_files_get(const char* path, const char* extension, char*** filesOut);
+int odroid_sdcard_files_get_info(const char* path, const char* extension, char*** filesOut, odroid_sdcard_file_info_t** infoOut);
 void odroid_sdcard_files_free(char** files, int count);
-esp_err_t odroid_sdcard_open();
+bool odroid_sdcard_get_info(const char* path, odroid_sdcard_file_info_t* out_info);
+esp_err_t odroid_sdcard_init();
+esp_err_t odroid_sdcard_open(const char* base_path, nvs_handle nvs);
+void odroid_sdcard_open_async(const char* base_path, nvs_handle nvs, int32_t job_id);
+odroid_sdcard_state_t odroid_sdcard_get_state();
 esp_err_t odroid_sdcard_close();
 size_t odroid_sdcard_get_filesize(const char* path);
 size_t odroid_sdcard_copy_file_to_memory(const char* path, void* ptr);
+
+odroid_sdcard_stream_t* odroid_sdcard_stream_open(const char* path, size_t offset, size_t length, int bufferCount, size_t bufferSize);
+int odroid_sdcard_stream_acquire(odroid_sdcard_stream_t* stream, const uint8_t** out_data);
+void odroid_sdcard_stream_release(odroid_sdcard_stream_t* stream);
+int odroid_sdcard_stream_read(odroid_sdcard_stream_t* stream, size_t max, const uint8_t** out_data);
+void odroid_sdcard_stream_close(odroid_sdcard_stream_t* stream);
@@ -0,0 +1,197 @@
+#include "odroid_spibus.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+// The LCD and the SD card share HSPI. The SPI master only serializes single
+// transactions, while sdspi drives its chip select by hand across a whole
+// command, so a display burst must never start in the middle of one. Each
+// client takes the bus for one burst (a few display lines, a run of sectors)
+// and the next owner is picked by priority.
+#define SPIBUS_WAITERS_MAX (8)
+
+// A waiter gains one priority level for every 2 ms it has been passed over,
+// about one SD burst, so nobody starves
+#define SPIBUS_AGING_US (2 * 1000)
+
+
+typedef struct
+{
+    SemaphoreHandle_t wake;
+    int64_t since;
+    uint8_t client;
+    uint8_t priority;
+    bool used;
+    bool granted;
+} spibus_waiter_t;
+
+static spibus_waiter_t waiters[SPIBUS_WAITERS_MAX];
+static int waiting = 0;
+static int owner = -1;
+static int64_t granted_at;
+static int64_t stats_since;
+static odroid_spibus_client_stats_t stats[ODROID_SPIBUS_CLIENT_COUNT];
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+
+
+// Called with the lock held
+static void spibus_grant(int client, int64_t now, int64_t since)
+{
+    odroid_spibus_client_stats_t* s = &stats[client];
+    uint32_t waited = now - since;
+
+    owner = client;
+    granted_at = now;
+
+    s->grants++;
+    s->wait_us += waited;
+    if (waited > s->max_wait_us) s->max_wait_us = waited;
+}
+
+
+void odroid_spibus_init()
+{
+    for (int i = 0; i < SPIBUS_WAITERS_MAX; ++i)
+    {
+        waiters[i].wake = xSemaphoreCreateBinary();
+        if (!waiters[i].wake) abort();
+    }
+
+    stats_since = esp_timer_get_time();
+
+    ESP_LOGI(__func__, "done.");
+}
+
+void odroid_spibus_acquire(int client, int priority)
+{
+    int64_t now = esp_timer_get_time();
+    spibus_waiter_t* waiter = NULL;
+
+    portENTER_CRITICAL(&lock);
+
+    if (owner < 0 && waiting == 0)
+    {
+        spibus_grant(client, now, now);
+        portEXIT_CRITICAL(&lock);
+        return;
+    }
+
+    for (int i = 0; i < SPIBUS_WAITERS_MAX; ++i)
+    {
+        if (!waiters[i].used)
+        {
+            waiter = &waiters[i];
+            break;
+        }
+    }
+
+    if (!waiter || !waiter->wake) abort();
+
+    waiter->used = true;
+    waiter->granted = false;
+    waiter->client = client;
+    waiter->priority = priority;
+    waiter->since = now;
+    waiting++;
+
+    portEXIT_CRITICAL(&lock);
+
+    xSemaphoreTake(waiter->wake, portMAX_DELAY);
+
+    // The slot stays taken until here so a new waiter can't consume our wake
+    portENTER_CRITICAL(&lock);
+    waiter->used = false;
+    portEXIT_CRITICAL(&lock);
+}
+
+void odroid_spibus_release(int client)
+{
+    int64_t now = esp_timer_get_time();
+    spibus_waiter_t* next = NULL;
+    int64_t best = 0;
+
+    portENTER_CRITICAL(&lock);
+
+    if (owner != client) abort();
+
+    stats[client].busy_us += now - granted_at;
+    owner = -1;
+
+    for (int i = 0; i < SPIBUS_WAITERS_MAX; ++i)
+    {
+        spibus_waiter_t* w = &waiters[i];
+        if (!w->used || w->granted) continue;
+
+        // Ties go to the longest waiting
+        int64_t score = (int64_t)w->priority * SPIBUS_AGING_US + (now - w->since);
+        if (!next || score > best)
+        {
+            next = w;
+            best = score;
+        }
+    }
+
+    if (next)
+    {
+        next->granted = true;
+        waiting--;
+        spibus_grant(next->client, now, next->since);
+    }
+
+    portEXIT_CRITICAL(&lock);
+
+    if (next) xSemaphoreGive(next->wake);
+}
+
+void odroid_spibus_get(odroid_spibus_stats_t* out_stats)
+{
+    int64_t now = esp_timer_get_time();
+
+    portENTER_CRITICAL(&lock);
+    memcpy(out_stats->clients, stats, sizeof(stats));
+    out_stats->elapsed_us = now - stats_since;
+
+    // Count the burst in progress too
+    if (owner >= 0) out_stats->clients[owner].busy_us += now - granted_at;
+    portEXIT_CRITICAL(&lock);
+}
+
+void odroid_spibus_reset()
+{
+    int64_t now = esp_timer_get_time();
+
+    portENTER_CRITICAL(&lock);
+    memset(stats, 0, sizeof(stats));
+    stats_since = now;
+    if (owner >= 0) granted_at = now;
+    portEXIT_CRITICAL(&lock);
+}
+
+void odroid_spibus_dump()
+{
+    static const char* names[ODROID_SPIBUS_CLIENT_COUNT] = { "LCD", "SD" };
+    odroid_spibus_stats_t s;
+
+    odroid_spibus_get(&s);
+
+    uint64_t elapsed = s.elapsed_us ? s.elapsed_us : 1;
+
+    printf("\n#################### HSPI bus (%llu ms) ####################\n", s.elapsed_us / 1000);
+
+    for (int i = 0; i < ODROID_SPIBUS_CLIENT_COUNT; ++i)
+    {
+        const odroid_spibus_client_stats_t* c = &s.clients[i];
+        uint32_t permille = c->busy_us * 1000 / elapsed;
+
+        printf("%-4s busy=%u.%u%%  bursts=%u  wait=%llu ms  max_wait=%u.%03u ms\n",
+            names[i], permille / 10, permille % 10, c->grants, c->wait_us / 1000,
+            c->max_wait_us / 1000, c->max_wait_us % 1000);
+    }
+}
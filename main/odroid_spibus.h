@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+enum
+{
+    ODROID_SPIBUS_LCD = 0,
+    ODROID_SPIBUS_SD,
+    ODROID_SPIBUS_CLIENT_COUNT,
+};
+
+enum
+{
+    ODROID_SPIBUS_PRIORITY_LOW = 0, // background drawing, progress
+    ODROID_SPIBUS_PRIORITY_NORMAL, // SD transfers
+    ODROID_SPIBUS_PRIORITY_HIGH, // frames answering a button press
+};
+
+typedef struct
+{
+    uint32_t grants;
+    uint64_t busy_us;
+    uint64_t wait_us;
+    uint32_t max_wait_us;
+} odroid_spibus_client_stats_t;
+
+typedef struct
+{
+    uint64_t elapsed_us;
+    odroid_spibus_client_stats_t clients[ODROID_SPIBUS_CLIENT_COUNT];
+} odroid_spibus_stats_t;
+
+void odroid_spibus_init();
+void odroid_spibus_acquire(int client, int priority);
+void odroid_spibus_release(int client);
+void odroid_spibus_get(odroid_spibus_stats_t* out_stats);
+void odroid_spibus_reset();
+void odroid_spibus_dump();